@@ -30,9 +30,11 @@
  * 
  * LEAF NODE:
  * ┌─────────────────────────────────────────────────────────────┐
- * │ Common Header (6 bytes)                                     │
- * │  - node_type: 1 byte (0=internal, 1=leaf)                  │
+ * │ Common Header (8 bytes)                                     │
+ * │  - node_type: 1 byte (low nibble: 0=internal, 1=leaf,      │
+ * │               high nibble: page format version)            │
  * │  - is_root: 1 byte (0=no, 1=yes)                           │
+ * │  - reserved: 2 bytes (keeps the u32 fields aligned)        │
  * │  - parent: 4 bytes (page number of parent)                 │
  * ├─────────────────────────────────────────────────────────────┤
  * │ Leaf Header (8 bytes)                                       │
@@ -43,11 +45,13 @@
  * │ Cell 1: [key: 4 bytes][row: 291 bytes]                     │
  * │ ...                                                         │
  * │ Cell N: [key: 4 bytes][row: 291 bytes]                     │
+ * ├─────────────────────────────────────────────────────────────┤
+ * │ Page trailer (4 bytes): CRC-32C, maintained by the pager    │
  * └─────────────────────────────────────────────────────────────┘
  * 
  * INTERNAL NODE:
  * ┌─────────────────────────────────────────────────────────────┐
- * │ Common Header (6 bytes)                                     │
+ * │ Common Header (8 bytes)                                     │
  * ├─────────────────────────────────────────────────────────────┤
  * │ Internal Header (8 bytes)                                   │
  * │  - num_keys: 4 bytes (number of child pointers - 1)        │
@@ -58,6 +62,8 @@
  * │ ...                                                         │
  * │ Cell N: [child_ptr: 4 bytes][max_key: 4 bytes]            │
  * │ Right Child: stored in header, no key needed               │
+ * ├─────────────────────────────────────────────────────────────┤
+ * │ Page trailer (4 bytes): CRC-32C, maintained by the pager    │
  * └─────────────────────────────────────────────────────────────┘
  * 
  * KEY INVARIANTS:
@@ -75,6 +81,19 @@
  * - SEARCH: Descend from root following key comparisons
  * - SCAN: Start at leftmost leaf, follow next_leaf pointers
  * 
+ * PAGE FORMAT VERSIONS:
+ * ---------------------
+ * The high nibble of the node_type byte records which layout a page uses.
+ * - v0: original layout, 6-byte common header (parent at offset 2), so every
+ *       u32 field after it sits at a 2-byte offset. Pages written before
+ *       versioning existed have a zero high nibble and read back as v0.
+ * - v1: current layout shown above, 8-byte common header.
+ * Readers understand every version (accessors compute offsets from the
+ * page's own format). Writers fetch pages through get_node_mut(), which
+ * upgrades a page to the current format before it is modified, so old
+ * files convert lazily as they are written. btree_upgrade_step() converts
+ * the remaining pages a few at a time in the background.
+ * 
  * REBALANCING STRATEGY:
  * ---------------------
  * When a node becomes underfull after deletion:
@@ -88,6 +107,9 @@
  */
 
 #include "btree.h"
+#include "cdc.h"
+#include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -111,13 +133,25 @@ static void die(const char *msg) {
 /* Common header */
 #define NODE_TYPE_SIZE        1
 #define IS_ROOT_SIZE          1
+#define NODE_RESERVED_SIZE    2
 #define PARENT_POINTER_SIZE   4
 
 #define NODE_TYPE_OFFSET      0
 #define IS_ROOT_OFFSET        (NODE_TYPE_OFFSET + NODE_TYPE_SIZE)
-#define PARENT_POINTER_OFFSET (IS_ROOT_OFFSET + IS_ROOT_SIZE)
+#define PARENT_POINTER_OFFSET (IS_ROOT_OFFSET + IS_ROOT_SIZE + NODE_RESERVED_SIZE)
+
+#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + NODE_RESERVED_SIZE + PARENT_POINTER_SIZE)
+
+/* Page format version lives in the high nibble of the node_type byte */
+#define NODE_TYPE_MASK        0x0F
+#define NODE_FORMAT_SHIFT     4
 
-#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE)
+#define NODE_FORMAT_V0        0   // legacy: 6-byte common header, no reserved bytes
+#define NODE_FORMAT_V1        1   // aligned 8-byte common header
+#define NODE_FORMAT_CURRENT   NODE_FORMAT_V1
+
+#define PARENT_POINTER_OFFSET_V0   (IS_ROOT_OFFSET + IS_ROOT_SIZE)
+#define COMMON_NODE_HEADER_SIZE_V0 (NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE)
 
 /* Leaf header: num_cells + next_leaf */
 #define LEAF_NODE_NUM_CELLS_SIZE   4
@@ -132,7 +166,7 @@ static void die(const char *msg) {
 #define LEAF_NODE_VALUE_SIZE  ((uint32_t)sizeof(Row))
 #define LEAF_NODE_CELL_SIZE   (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
 
-#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
+#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_USABLE_SIZE - LEAF_NODE_HEADER_SIZE)
 #define LEAF_NODE_MAX_CELLS       (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
 
 /* Internal header: num_keys + right_child */
@@ -148,17 +182,47 @@ static void die(const char *msg) {
 #define INTERNAL_NODE_KEY_SIZE   4
 #define INTERNAL_NODE_CELL_SIZE  (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
 
-#define INTERNAL_NODE_SPACE_FOR_CELLS (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_SPACE_FOR_CELLS (PAGE_USABLE_SIZE - INTERNAL_NODE_HEADER_SIZE)
 #define INTERNAL_NODE_MAX_KEYS        (INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE)
 #define INTERNAL_NODE_MAX_CHILDREN    (INTERNAL_NODE_MAX_KEYS + 1)
 
+/* Upgrading in place must never push cells past the end of the page */
+_Static_assert((PAGE_USABLE_SIZE - (LEAF_NODE_HEADER_SIZE - COMMON_NODE_HEADER_SIZE + COMMON_NODE_HEADER_SIZE_V0))
+                   / LEAF_NODE_CELL_SIZE == LEAF_NODE_MAX_CELLS,
+               "v0 leaf capacity must match current format");
+_Static_assert((PAGE_USABLE_SIZE - (INTERNAL_NODE_HEADER_SIZE - COMMON_NODE_HEADER_SIZE + COMMON_NODE_HEADER_SIZE_V0))
+                   / INTERNAL_NODE_CELL_SIZE == INTERNAL_NODE_MAX_KEYS,
+               "v0 internal capacity must match current format");
+
 /* ---------- Common accessors ---------- */
 
+static uint8_t get_node_format(void *node) {
+    return (uint8_t)(*((uint8_t *)node + NODE_TYPE_OFFSET) >> NODE_FORMAT_SHIFT);
+}
+static void set_node_format(void *node, uint8_t format) {
+    uint8_t *b = (uint8_t *)node + NODE_TYPE_OFFSET;
+    *b = (uint8_t)((*b & NODE_TYPE_MASK) | (format << NODE_FORMAT_SHIFT));
+}
+
+/*
+ * Bytes taken by the common header. Every other offset is derived from this,
+ * so readers handle legacy (v0) and current pages alike.
+ */
+static uint32_t node_header_size(void *node) {
+    return get_node_format(node) == NODE_FORMAT_V0
+        ? COMMON_NODE_HEADER_SIZE_V0
+        : COMMON_NODE_HEADER_SIZE;
+}
+
 static NodeType get_node_type(void *node) {
-    return (NodeType)(*((uint8_t *)node + NODE_TYPE_OFFSET));
+    return (NodeType)(*((uint8_t *)node + NODE_TYPE_OFFSET) & NODE_TYPE_MASK);
+}
+bool btree_page_is_internal(const void *page) {
+    return get_node_type((void *)page) == NODE_INTERNAL;
 }
 static void set_node_type(void *node, NodeType type) {
-    *((uint8_t *)node + NODE_TYPE_OFFSET) = (uint8_t)type;
+    uint8_t *b = (uint8_t *)node + NODE_TYPE_OFFSET;
+    *b = (uint8_t)((*b & ~NODE_TYPE_MASK) | ((uint8_t)type & NODE_TYPE_MASK));
 }
 static bool is_node_root(void *node) {
     return *((uint8_t *)node + IS_ROOT_OFFSET) != 0;
@@ -167,19 +231,23 @@ static void set_node_root(void *node, bool is_root) {
     *((uint8_t *)node + IS_ROOT_OFFSET) = is_root ? 1 : 0;
 }
 static uint32_t *node_parent(void *node) {
-    return (uint32_t *)((uint8_t *)node + PARENT_POINTER_OFFSET);
+    uint32_t offset = get_node_format(node) == NODE_FORMAT_V0
+        ? PARENT_POINTER_OFFSET_V0
+        : PARENT_POINTER_OFFSET;
+    return (uint32_t *)((uint8_t *)node + offset);
 }
 
 /* ---------- Leaf accessors ---------- */
 
 static uint32_t *leaf_node_num_cells(void *node) {
-    return (uint32_t *)((uint8_t *)node + LEAF_NODE_NUM_CELLS_OFFSET);
+    return (uint32_t *)((uint8_t *)node + node_header_size(node));
 }
 static uint32_t *leaf_node_next_leaf(void *node) {
-    return (uint32_t *)((uint8_t *)node + LEAF_NODE_NEXT_LEAF_OFFSET);
+    return (uint32_t *)((uint8_t *)node + node_header_size(node) + LEAF_NODE_NUM_CELLS_SIZE);
 }
 static void *leaf_node_cell(void *node, uint32_t cell_num) {
-    return (uint8_t *)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+    uint32_t header = node_header_size(node) + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
+    return (uint8_t *)node + header + cell_num * LEAF_NODE_CELL_SIZE;
 }
 static uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
     return (uint32_t *)((uint8_t *)leaf_node_cell(node, cell_num));
@@ -191,13 +259,14 @@ static void *leaf_node_value(void *node, uint32_t cell_num) {
 /* ---------- Internal accessors ---------- */
 
 static uint32_t *internal_node_num_keys(void *node) {
-    return (uint32_t *)((uint8_t *)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+    return (uint32_t *)((uint8_t *)node + node_header_size(node));
 }
 static uint32_t *internal_node_right_child(void *node) {
-    return (uint32_t *)((uint8_t *)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+    return (uint32_t *)((uint8_t *)node + node_header_size(node) + INTERNAL_NODE_NUM_KEYS_SIZE);
 }
 static void *internal_node_cell(void *node, uint32_t cell_num) {
-    return (uint8_t *)node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+    uint32_t header = node_header_size(node) + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+    return (uint8_t *)node + header + cell_num * INTERNAL_NODE_CELL_SIZE;
 }
 static uint32_t *internal_node_child(void *node, uint32_t cell_num) {
     return (uint32_t *)internal_node_cell(node, cell_num);
@@ -206,9 +275,51 @@ static uint32_t *internal_node_key(void *node, uint32_t cell_num) {
     return (uint32_t *)((uint8_t *)internal_node_cell(node, cell_num) + INTERNAL_NODE_CHILD_SIZE);
 }
 
+/* ---------- Format upgrade ---------- */
+
+/*
+ * node_upgrade - Rewrite a page in the current format, in place
+ *
+ * v0 -> v1: the header grows from 6 to 8 bytes, so everything after the
+ * common header slides right by 2 bytes and the parent pointer moves to its
+ * aligned slot. The static asserts above guarantee the cells still fit.
+ *
+ * Returns: true if the page was rewritten
+ */
+static bool node_upgrade(void *node) {
+    if (get_node_format(node) == NODE_FORMAT_CURRENT) return false;
+
+    uint8_t *p = (uint8_t *)node;
+    uint32_t parent = *node_parent(node);
+
+    memmove(p + COMMON_NODE_HEADER_SIZE,
+            p + COMMON_NODE_HEADER_SIZE_V0,
+            PAGE_USABLE_SIZE - COMMON_NODE_HEADER_SIZE);
+    memset(p + IS_ROOT_OFFSET + IS_ROOT_SIZE, 0, NODE_RESERVED_SIZE);
+
+    set_node_format(node, NODE_FORMAT_CURRENT);
+    *node_parent(node) = parent;
+    return true;
+}
+
+/*
+ * get_node_mut - Fetch a page that is about to be modified
+ *
+ * All write paths go through here instead of pager_get_page() so that a
+ * legacy page is converted the first time it is dirtied, and so the pager
+ * learns which pages changed.
+ */
+static void *get_node_mut(Table *t, uint32_t page_num) {
+    void *node = pager_get_page(t->pager, page_num);
+    node_upgrade(node);
+    pager_mark_dirty(t->pager, page_num);
+    return node;
+}
+
 /* Forward declarations for rebalancing */
 static void internal_node_update_key_for_child(Table *t, uint32_t parent_page, uint32_t child_page);
 static void internal_node_remove_child(Table *t, uint32_t parent_page, uint32_t child_page);
+static void release_page(Table *t, uint32_t page);
 static void internal_node_rebuild(Table *t, uint32_t internal_page, uint32_t *children, uint32_t count);
 
 
@@ -358,13 +469,13 @@ static bool try_borrow_from_left(
 ) {
     if (!left_page) return false;  // No left sibling exists
 
-    void *leaf = pager_get_page(t->pager, leaf_page);
-    void *left = pager_get_page(t->pager, left_page);
-
     /* Can only borrow if left has more than minimum */
-    if (*leaf_node_num_cells(left) <= LEAF_NODE_MIN_CELLS)
+    if (*leaf_node_num_cells(pager_get_page(t->pager, left_page)) <= LEAF_NODE_MIN_CELLS)
         return false;
 
+    void *leaf = get_node_mut(t, leaf_page);
+    void *left = get_node_mut(t, left_page);
+
     /* Shift current node's cells right to make room at position 0 */
     memmove(
         leaf_node_cell(leaf, 1),
@@ -421,13 +532,13 @@ static bool try_borrow_from_right(
 ) {
     if (!right_page) return false;  // No right sibling exists
 
-    void *leaf = pager_get_page(t->pager, leaf_page);
-    void *right = pager_get_page(t->pager, right_page);
-
     /* Can only borrow if right has more than minimum */
-    if (*leaf_node_num_cells(right) <= LEAF_NODE_MIN_CELLS)
+    if (*leaf_node_num_cells(pager_get_page(t->pager, right_page)) <= LEAF_NODE_MIN_CELLS)
         return false;
 
+    void *leaf = get_node_mut(t, leaf_page);
+    void *right = get_node_mut(t, right_page);
+
     /* Append first cell of right sibling to end of current node */
     memcpy(
         leaf_node_cell(leaf, *leaf_node_num_cells(leaf)),
@@ -484,7 +595,7 @@ static void merge_leaf_nodes(
     uint32_t right_page,
     uint32_t parent_page
 ) {
-    void *left = pager_get_page(t->pager, left_page);
+    void *left = get_node_mut(t, left_page);
     void *right = pager_get_page(t->pager, right_page);
 
     uint32_t left_n = *leaf_node_num_cells(left);
@@ -506,6 +617,10 @@ static void merge_leaf_nodes(
 
     /* Remove right node from parent (this may trigger parent rebalancing!) */
     internal_node_remove_child(t, parent_page, right_page);
+
+    /* Right is no longer part of the tree */
+    if (t->finger_page == right_page) t->finger_page = 0;
+    release_page(t, right_page);
 }
 
 /*
@@ -542,13 +657,15 @@ static void maybe_shrink_root(Table *t) {
         *internal_node_num_keys(root) == 0) {
 
         /* The only remaining child becomes the new root */
+        uint32_t old_root = t->header.root_page_num;
         uint32_t new_root = *internal_node_right_child(root);
 
-        void *child = pager_get_page(t->pager, new_root);
+        void *child = get_node_mut(t, new_root);
         set_node_root(child, true);
         *node_parent(child) = 0;  // Root has no parent
 
         t->header.root_page_num = new_root;
+        release_page(t, old_root);
     }
 }
 
@@ -781,6 +898,7 @@ static void merge_internal_nodes(
 
     // Remove right from parent (this may trigger recursive rebalancing)
     internal_node_remove_child(t, parent_page, right_page);
+    release_page(t, right_page);
 }
 
 static void rebalance_internal(Table *t, uint32_t internal_page) {
@@ -828,11 +946,113 @@ static void deserialize_row(const void *src, Row *dst) { memcpy(dst, src, sizeof
 
 /* ============================================================
  * Page allocation
+ *
+ * The file is reserved in aligned extents of BTREE_EXTENT_PAGES pages,
+ * and next_free_page marks the end of the reserved region. A leaf split
+ * asks for a page near the leaf being split and gets the next free page
+ * in that leaf's extent, so neighbouring leaves stay close together in
+ * the file and a range scan reads mostly forward:
+ *
+ *   extent 1: [L3 L7 L8 L9 -- -- ...]   L7 splits -> L10 lands in slot 4
+ *
+ * A full extent makes the split reserve a fresh one at the end of the
+ * file. Pages wanted anywhere (internal nodes, root copies) fill the
+ * first free slot. Only when no fresh extent fits does a leaf take a
+ * slot elsewhere, so nothing is wasted.
  * ============================================================ */
 
+static bool page_in_use(const Table *t, uint32_t page) {
+    return page / 8 < t->page_map_size && ((t->page_map[page / 8] >> (page % 8)) & 1);
+}
+
+static uint32_t take_page(Table *t, uint32_t page) {
+    if (page / 8 >= t->page_map_size) {
+        uint32_t size = t->page_map_size ? t->page_map_size : PAGER_CHANGE_MAP_SIZE;
+        while (size <= page / 8) size *= 2;
+
+        uint8_t *map = realloc(t->page_map, size);
+        if (!map) die("realloc");
+        memset(map + t->page_map_size, 0, size - t->page_map_size);
+        t->page_map = map;
+        t->page_map_size = size;
+    }
+    t->page_map[page / 8] |= (uint8_t)(1u << (page % 8));
+    return page;
+}
+
+/* First page in [from, to) not in use, or 0 */
+static uint32_t first_free_page(const Table *t, uint32_t from, uint32_t to) {
+    for (uint32_t p = from; p < to; p++) {
+        if (!page_in_use(t, p)) return p;
+    }
+    return 0;
+}
+
+/* At least need pages still available: free slots in reserved extents
+ * plus the unreserved rest, counted only until enough are found */
+static bool pages_available(const Table *t, uint32_t need) {
+    uint32_t n = t->pager->max_pages - t->header.next_free_page;
+    for (uint32_t p = 1; p < t->header.next_free_page && n < need; p++) n += !page_in_use(t, p);
+    return n >= need;
+}
+
+/* Levels from the root down, leaves included */
+static uint32_t tree_depth(Table *t) {
+    uint32_t depth = 1;
+    void *node = pager_get_page(t->pager, t->header.root_page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        node = pager_get_page(t->pager, *internal_node_right_child(node));
+        depth++;
+    }
+    return depth;
+}
+
+/*
+ * Pages one insert may allocate: a leaf split that climbs every level
+ * takes a page per level, and the root split takes two (new root plus
+ * the old root's copy).
+ */
+static uint32_t insert_page_budget(Table *t) {
+    return tree_depth(t) + 1;
+}
+
+static uint32_t allocate_page_near(Table *t, uint32_t near_page) {
+    uint32_t end = t->header.next_free_page;
+    uint32_t max = t->pager->max_pages;
+
+    if (near_page) {
+        uint32_t first = near_page / BTREE_EXTENT_PAGES * BTREE_EXTENT_PAGES;
+        uint32_t last = first + BTREE_EXTENT_PAGES < end ? first + BTREE_EXTENT_PAGES : end;
+
+        // forward of the sibling first, so a scan keeps reading ahead
+        uint32_t p = first_free_page(t, near_page + 1, last);
+        if (!p) p = first_free_page(t, first ? first : 1, near_page);
+        if (!p) p = first_free_page(t, last, last + BTREE_EXTENT_PAGES < end ? last + BTREE_EXTENT_PAGES : end);
+        if (p) return take_page(t, p);
+
+        uint32_t fresh = (end + BTREE_EXTENT_PAGES - 1) / BTREE_EXTENT_PAGES * BTREE_EXTENT_PAGES;
+        if (fresh < max) {
+            t->header.next_free_page = fresh + BTREE_EXTENT_PAGES < max ? fresh + BTREE_EXTENT_PAGES : max;
+            return take_page(t, fresh);
+        }
+    }
+
+    uint32_t p = first_free_page(t, 1, end);
+    if (p) return take_page(t, p);
+
+    if (end >= max) die("out of pages");
+    t->header.next_free_page++;
+    return take_page(t, end);
+}
+
 static uint32_t allocate_page(Table *t) {
-    if (t->header.next_free_page >= TABLE_MAX_PAGES) die("out of pages");
-    return t->header.next_free_page++;
+    return allocate_page_near(t, 0);
+}
+
+/* A page unlinked from the tree goes back to the allocator; the pager drops it */
+static void release_page(Table *t, uint32_t page) {
+    t->page_map[page / 8] &= (uint8_t)~(1u << (page % 8));
+    pager_release(t->pager, page);
 }
 
 /* ============================================================
@@ -862,7 +1082,7 @@ static void internal_node_rebuild(Table *t, uint32_t internal_page, uint32_t *ch
     if (count < 2) die("internal rebuild needs >=2 children");
     if (count > INTERNAL_NODE_MAX_CHILDREN) die("internal rebuild too many children");
 
-    void *node = pager_get_page(t->pager, internal_page);
+    void *node = get_node_mut(t, internal_page);
 
     bool root_flag = is_node_root(node);
     uint32_t parent_page = *node_parent(node);
@@ -873,7 +1093,7 @@ static void internal_node_rebuild(Table *t, uint32_t internal_page, uint32_t *ch
 
     // Set parent pointers on children
     for (uint32_t i = 0; i < count; i++) {
-        void *child_node = pager_get_page(t->pager, children[i]);
+        void *child_node = get_node_mut(t, children[i]);
         *node_parent(child_node) = internal_page;
         // keep child's is_root as-is (should be false unless it's the actual root page)
         if (is_node_root(child_node)) set_node_root(child_node, false);
@@ -934,8 +1154,8 @@ static uint32_t internal_node_find_child(void *internal, int32_t key) {
  * Find leaf position (binary search in leaf)
  * ============================================================ */
 
-static Cursor *leaf_node_find(Table *t, uint32_t leaf_page, int32_t key) {
-    void *leaf = pager_get_page(t->pager, leaf_page);
+/* Cell holding key, or where it would be inserted; returns true if present */
+static bool leaf_node_search(void *leaf, int32_t key, uint32_t *cell_num) {
     uint32_t n = *leaf_node_num_cells(leaf);
 
     uint32_t left = 0;
@@ -946,10 +1166,8 @@ static Cursor *leaf_node_find(Table *t, uint32_t leaf_page, int32_t key) {
         int32_t mid_key = (int32_t)(*leaf_node_key(leaf, mid));
 
         if (mid_key == key) {
-            Cursor *c = calloc(1, sizeof(Cursor));
-            c->table = t; c->page_num = leaf_page; c->cell_num = mid;
-            c->end_of_table = false;
-            return c;
+            *cell_num = mid;
+            return true;
         } else if (mid_key < key) {
             left = mid + 1;
         } else {
@@ -957,22 +1175,65 @@ static Cursor *leaf_node_find(Table *t, uint32_t leaf_page, int32_t key) {
         }
     }
 
+    *cell_num = left;
+    return false;
+}
+
+static Cursor *leaf_node_find(Table *t, uint32_t leaf_page, int32_t key) {
+    void *leaf = pager_get_page(t->pager, leaf_page);
+    uint32_t cell = 0;
+    bool found = leaf_node_search(leaf, key, &cell);
+
     Cursor *c = calloc(1, sizeof(Cursor));
-    c->table = t; c->page_num = leaf_page; c->cell_num = left;
-    c->end_of_table = (left >= n);
+    c->table = t; c->page_num = leaf_page; c->cell_num = cell;
+    c->end_of_table = !found && cell >= *leaf_node_num_cells(leaf);
     return c;
 }
 
 /* ============================================================
  * Descend tree to find leaf for a key
+ *
+ * Internal nodes are pinned in the cache (Pager.keep_resident), so
+ * their frames never move or disappear: a resident internal node is
+ * followed straight through the frame table, skipping the statistics
+ * and queue work of pager_get_page. Leaves and pages that still have
+ * to be read in take the normal path.
  * ============================================================ */
 
+static void *descend_node(Table *t, uint32_t page) {
+    void *node = pager_frame(t->pager, page);
+    if (node && get_node_type(node) == NODE_INTERNAL) return node;
+    return pager_get_page(t->pager, page);
+}
+
+/*
+ * Finger search: the leaf the previous descent ended in is tried first.
+ * A leaf's keys are a contiguous run of the key order, so any key between
+ * its first and last key belongs to it whatever the separators above say,
+ * and the rightmost leaf (no next leaf) takes everything past its first
+ * key. Keys in the gaps between leaves take the full descent.
+ * merge_leaf_nodes forgets the finger when it unlinks that leaf.
+ */
+static bool finger_covers(Table *t, int32_t key) {
+    if (t->finger_page == 0) return false;
+
+    void *leaf = pager_frame(t->pager, t->finger_page);
+    if (!leaf || get_node_type(leaf) != NODE_LEAF) return false;
+
+    uint32_t n = *leaf_node_num_cells(leaf);
+    if (n == 0 || key < (int32_t)*leaf_node_key(leaf, 0)) return false;
+    return key <= (int32_t)*leaf_node_key(leaf, n - 1) || *leaf_node_next_leaf(leaf) == 0;
+}
+
 Cursor *btree_table_find(Table *t, int32_t key) {
+    if (finger_covers(t, key)) return leaf_node_find(t, t->finger_page, key);
+
     uint32_t page = t->header.root_page_num;
 
     while (true) {
-        void *node = pager_get_page(t->pager, page);
+        void *node = descend_node(t, page);
         if (get_node_type(node) == NODE_LEAF) {
+            t->finger_page = page;
             return leaf_node_find(t, page, key);
         }
 
@@ -987,6 +1248,109 @@ Cursor *btree_table_find(Table *t, int32_t key) {
     }
 }
 
+/* ============================================================
+ * Multi-get
+ *
+ * Keys are sorted, so the keys under any node form one contiguous
+ * slice. Each node splits its slice among its children in a single
+ * merge pass and starts fetching every child before visiting any of
+ * them: a resident child is prefetched into the CPU cache (its header
+ * and the middle of the page, where a full node's first binary-search
+ * probe lands), one that is not asks the pager to start the disk read. While the first child is searched, the misses
+ * for its siblings are already in flight, so the descents of a level
+ * overlap instead of stalling one after another. A leaf matches its
+ * slice against its cells in one merge.
+ * ============================================================ */
+
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
+static int compare_keys(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void prefetch_node(Table *t, uint32_t page) {
+    uint8_t *node = pager_frame(t->pager, page);
+    if (!node) {
+        pager_prefetch(t->pager, page);
+        return;
+    }
+    PREFETCH(node);
+    PREFETCH(node + PAGE_SIZE / 2);
+}
+
+static void find_many_node(Table *t, uint32_t page, const int32_t *keys, size_t n,
+                           BTreeFindFn fn, void *ctx) {
+    void *node = descend_node(t, page);
+
+    if (get_node_type(node) == NODE_LEAF) {
+        node = pager_get_page(t->pager, page);
+        uint32_t cells = *leaf_node_num_cells(node);
+        uint32_t j = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            while (j < cells && (int32_t)*leaf_node_key(node, j) < keys[i]) j++;
+            if (j < cells && (int32_t)*leaf_node_key(node, j) == keys[i]) {
+                Row row;
+                deserialize_row(leaf_node_value(node, j), &row);
+                fn(keys[i], &row, ctx);
+            } else {
+                fn(keys[i], NULL, ctx);
+            }
+        }
+        return;
+    }
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t child_pages[INTERNAL_NODE_MAX_CHILDREN];
+    size_t child_first[INTERNAL_NODE_MAX_CHILDREN];
+    size_t child_count[INTERNAL_NODE_MAX_CHILDREN];
+    uint32_t used = 0;
+
+    // Child i takes keys up to separator i; the right child takes the rest
+    uint32_t idx = 0;
+    for (size_t i = 0; i < n; i++) {
+        while (idx < num_keys && (int32_t)*internal_node_key(node, idx) < keys[i]) idx++;
+        uint32_t child = (idx == num_keys) ? *internal_node_right_child(node)
+                                           : *internal_node_child(node, idx);
+
+        if (used > 0 && child_pages[used - 1] == child) {
+            child_count[used - 1]++;
+            continue;
+        }
+        child_pages[used] = child;
+        child_first[used] = i;
+        child_count[used] = 1;
+        used++;
+    }
+
+    for (uint32_t c = 0; c < used; c++) prefetch_node(t, child_pages[c]);
+    for (uint32_t c = 0; c < used; c++) {
+        find_many_node(t, child_pages[c], keys + child_first[c], child_count[c], fn, ctx);
+    }
+}
+
+void btree_find_many(Table *t, const int32_t *keys, size_t n, BTreeFindFn fn, void *ctx) {
+    if (n == 0) return;
+
+    int32_t *sorted = malloc(n * sizeof(int32_t));
+    if (!sorted) die("malloc");
+    memcpy(sorted, keys, n * sizeof(int32_t));
+    qsort(sorted, n, sizeof(int32_t), compare_keys);
+
+    size_t distinct = 1;
+    for (size_t i = 1; i < n; i++) {
+        if (sorted[i] != sorted[distinct - 1]) sorted[distinct++] = sorted[i];
+    }
+
+    find_many_node(t, t->header.root_page_num, sorted, distinct, fn, ctx);
+    free(sorted);
+}
+
 /* ============================================================
  * Cursor API
  * ============================================================ */
@@ -996,7 +1360,7 @@ Cursor *btree_table_start(Table *t) {
 
     // go to leftmost leaf
     while (true) {
-        void *node = pager_get_page(t->pager, page);
+        void *node = descend_node(t, page);
         if (get_node_type(node) == NODE_LEAF) break;
 
         // leftmost child is child(0)
@@ -1019,6 +1383,11 @@ void *btree_cursor_value(Cursor *c) {
     return leaf_node_value(leaf, c->cell_num);
 }
 
+/* Leaf-to-leaf steps after which a cursor walk is read as a sequential scan */
+#define SCAN_DETECT_LEAF_HOPS 2
+
+static void cursor_next_leaf(Cursor *c, void *leaf);
+
 void btree_cursor_advance(Cursor *c) {
     void *leaf = pager_get_page(c->table->pager, c->page_num);
     uint32_t n = *leaf_node_num_cells(leaf);
@@ -1026,6 +1395,11 @@ void btree_cursor_advance(Cursor *c) {
     c->cell_num++;
     if (c->cell_num < n) return;
 
+    cursor_next_leaf(c, leaf);
+}
+
+/* Moves the cursor to the first cell of the leaf after this one */
+static void cursor_next_leaf(Cursor *c, void *leaf) {
     uint32_t next = *leaf_node_next_leaf(leaf);
     if (next == 0) {
         c->end_of_table = true;
@@ -1035,11 +1409,62 @@ void btree_cursor_advance(Cursor *c) {
     c->page_num = next;
     c->cell_num = 0;
 
-    void *leaf2 = pager_get_page(c->table->pager, next);
+    // Past a couple of leaves this is a sequential scan: keep it out of the hot set
+    void *leaf2 = (++c->leaf_hops >= SCAN_DETECT_LEAF_HOPS)
+        ? pager_get_page_scan(c->table->pager, next)
+        : pager_get_page(c->table->pager, next);
     c->end_of_table = (*leaf_node_num_cells(leaf2) == 0);
 }
 
-void btree_cursor_free(Cursor *c) { free(c); }
+static void cursor_unpin_batch(Cursor *c) {
+    for (uint32_t i = 0; i < c->num_pinned; i++) pager_unpin(c->table->pager, c->pinned[i]);
+    c->num_pinned = 0;
+}
+
+static void cursor_pin(Cursor *c, uint32_t page) {
+    if (c->num_pinned == c->pinned_cap) {
+        c->pinned_cap = c->pinned_cap ? c->pinned_cap * 2 : 4;
+        c->pinned = realloc(c->pinned, c->pinned_cap * sizeof(uint32_t));
+        if (!c->pinned) die("realloc");
+    }
+    pager_pin(c->table->pager, page);
+    c->pinned[c->num_pinned++] = page;
+}
+
+/*
+ * btree_cursor_next_batch - Hand out rows in place, a leaf at a time
+ *
+ * One page lookup per leaf instead of two per row: each leaf is fetched
+ * and pinned once, then its cells are copied out as views until the batch
+ * is full. The leaf walk itself is btree_cursor_advance's, scan detection
+ * included.
+ */
+size_t btree_cursor_next_batch(Cursor *c, RowView *out, size_t max) {
+    cursor_unpin_batch(c);
+
+    size_t count = 0;
+    while (count < max && !c->end_of_table) {
+        uint8_t *leaf = pager_get_page(c->table->pager, c->page_num);
+        uint32_t n = *leaf_node_num_cells(leaf);
+        cursor_pin(c, c->page_num);
+
+        for (; c->cell_num < n && count < max; c->cell_num++, count++) {
+            const uint8_t *value = leaf_node_value(leaf, c->cell_num);
+            memcpy(&out[count].id, value + offsetof(Row, id), sizeof(int32_t));
+            out[count].username = (const char *)value + offsetof(Row, username);
+            out[count].email = (const char *)value + offsetof(Row, email);
+        }
+
+        if (c->cell_num >= n) cursor_next_leaf(c, leaf);
+    }
+    return count;
+}
+
+void btree_cursor_free(Cursor *c) {
+    cursor_unpin_batch(c);
+    free(c->pinned);
+    free(c);
+}
 
 /* ============================================================
  * Parent updates
@@ -1053,7 +1478,8 @@ static void internal_node_update_key_for_child(Table *t, uint32_t parent_page, u
 
     for (uint32_t i = 0; i < num_keys; i++) {
         if (*internal_node_child(parent, i) == child_page) {
-            *internal_node_key(parent, i) = get_node_max_key(t, child_page);
+            uint32_t key = get_node_max_key(t, child_page);
+            if (*internal_node_key(parent, i) != key) *internal_node_key(get_node_mut(t, parent_page), i) = key;
             return;
         }
     }
@@ -1062,7 +1488,7 @@ static void internal_node_update_key_for_child(Table *t, uint32_t parent_page, u
 
 /* Remove a child from internal node */
 static void internal_node_remove_child(Table *t, uint32_t parent_page, uint32_t child_page) {
-    void *parent = pager_get_page(t->pager, parent_page);
+    void *parent = get_node_mut(t, parent_page);
     uint32_t num_keys = *internal_node_num_keys(parent);
 
     // Collect all children except the one to remove
@@ -1091,7 +1517,7 @@ static void internal_node_remove_child(Table *t, uint32_t parent_page, uint32_t
 
         // To avoid breaking recursive balance, future deletes, root shrinking, set child's 
         // parent pointer
-        void *only = pager_get_page(t->pager, children[0]);
+        void *only = get_node_mut(t, children[0]);
         *node_parent(only) = parent_page;
     }
 
@@ -1137,17 +1563,27 @@ static void internal_node_remove_child(Table *t, uint32_t parent_page, uint32_t
  */
 static void create_new_root(Table *t, uint32_t right_child_page) {
     uint32_t root_page = t->header.root_page_num;
-    void *root = pager_get_page(t->pager, root_page);
+    void *root = get_node_mut(t, root_page);
 
     /* Allocate new page to hold old root's content (becomes left child) */
     uint32_t left_child_page = allocate_page(t);
-    void *left_child = pager_get_page(t->pager, left_child_page);
+    void *left_child = get_node_mut(t, left_child_page);
 
     /* Move old root content to left_child */
     memcpy(left_child, root, PAGE_SIZE);
     set_node_root(left_child, false);  // No longer root
     *node_parent(left_child) = root_page;
 
+    /* An internal root's children now hang off left_child */
+    if (get_node_type(left_child) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(left_child);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            uint32_t child = (i == num_keys) ? *internal_node_right_child(left_child)
+                                             : *internal_node_child(left_child, i);
+            *node_parent(get_node_mut(t, child)) = left_child_page;
+        }
+    }
+
     /* Transform root into internal node */
     initialize_internal_node(root);
     set_node_root(root, true);
@@ -1196,7 +1632,7 @@ static void internal_node_insert_child(Table *t, uint32_t parent_page, uint32_t
 
     // split internal
     uint32_t new_internal_page = allocate_page(t);
-    void *new_internal = pager_get_page(t->pager, new_internal_page);
+    void *new_internal = get_node_mut(t, new_internal_page);
     initialize_internal_node(new_internal);
 
     // keep parent/root flags and parent pointer will be set via rebuild
@@ -1252,7 +1688,7 @@ static void insert_into_parent(Table *t, uint32_t left_page, uint32_t right_page
  * ============================================================ */
 
 static bool leaf_insert_no_split(Table *t, Cursor *c, int32_t key, const Row *row) {
-    void *leaf = pager_get_page(t->pager, c->page_num);
+    void *leaf = get_node_mut(t, c->page_num);
     uint32_t n = *leaf_node_num_cells(leaf);
 
     if (n >= LEAF_NODE_MAX_CELLS) return false;
@@ -1277,12 +1713,12 @@ static bool leaf_insert_no_split(Table *t, Cursor *c, int32_t key, const Row *ro
 
 static void leaf_split_and_insert(Table *t, Cursor *c, int32_t key, const Row *row) {
     uint32_t old_page = c->page_num;
-    void *old_leaf = pager_get_page(t->pager, old_page);
+    void *old_leaf = get_node_mut(t, old_page);
     uint32_t old_n = *leaf_node_num_cells(old_leaf);
 
-    // new leaf
-    uint32_t new_page = allocate_page(t);
-    void *new_leaf = pager_get_page(t->pager, new_page);
+    // new leaf, next to the old one in the file where possible
+    uint32_t new_page = allocate_page_near(t, old_page);
+    void *new_leaf = get_node_mut(t, new_page);
     initialize_leaf_node(new_leaf);
 
     // link new leaf into list
@@ -1341,6 +1777,48 @@ static void leaf_split_and_insert(Table *t, Cursor *c, int32_t key, const Row *r
  * Public insert API
  * ============================================================ */
 
+/* Inserts a new key at the cursor's position, splitting if the leaf is full */
+static void leaf_insert_row(Table *t, Cursor *c, const Row *row) {
+    if (t->cdc) cdc_append(t->cdc, CDC_OP_INSERT, row);
+
+    if (!leaf_insert_no_split(t, c, row->id, row)) {
+        leaf_split_and_insert(t, c, row->id, row);
+    }
+    t->header.num_rows++;
+}
+
+/* Removes one cell; the caller decides about rebalancing */
+static void leaf_remove_cell(Table *t, uint32_t leaf_page, uint32_t cell_num, int32_t key) {
+    void *leaf = get_node_mut(t, leaf_page);
+    uint32_t n = *leaf_node_num_cells(leaf);
+
+    /* Shift cells left */
+    for (uint32_t i = cell_num + 1; i < n; i++) {
+        memmove(
+            leaf_node_cell(leaf, i - 1),
+            leaf_node_cell(leaf, i),
+            LEAF_NODE_CELL_SIZE
+        );
+    }
+
+    *leaf_node_num_cells(leaf) = n - 1;
+    t->header.num_rows--;
+
+    if (t->cdc) {
+        Row deleted = { .id = key };
+        cdc_append(t->cdc, CDC_OP_DELETE, &deleted);
+    }
+}
+
+/* The change feed has no update record: a replace is a delete (id only,
+ * as leaf_remove_cell writes it) plus an insert of the new row */
+static void feed_replace(Table *t, const Row *row) {
+    if (!t->cdc) return;
+    Row deleted = { .id = row->id };
+    cdc_append(t->cdc, CDC_OP_DELETE, &deleted);
+    cdc_append(t->cdc, CDC_OP_INSERT, row);
+}
+
 bool btree_insert(Table *t, const Row *row, char *errbuf, uint32_t errbuf_sz) {
     // find insertion point
     Cursor *c = btree_table_find(t, row->id);
@@ -1357,22 +1835,21 @@ bool btree_insert(Table *t, const Row *row, char *errbuf, uint32_t errbuf_sz) {
         }
     }
 
-    if (leaf_insert_no_split(t, c, row->id, row)) {
-        t->header.num_rows++;
+    // a split that ran out of pages halfway would leave the tree broken
+    if (n >= LEAF_NODE_MAX_CELLS && !pages_available(t, insert_page_budget(t))) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "database full");
         btree_cursor_free(c);
-        return true;
+        return false;
     }
 
-    // split
-    leaf_split_and_insert(t, c, row->id, row);
-    t->header.num_rows++;
+    leaf_insert_row(t, c, row);
     btree_cursor_free(c);
     return true;
 }
 
 bool btree_delete(Table *t, int32_t key, char *errbuf, uint32_t errbuf_sz) {
     Cursor *c = btree_table_find(t, key);
-    void *leaf = pager_get_page(t->pager, c->page_num);
+    void *leaf = pager_get_page(t->pager, c->page_num);  // a missing key must not dirty it
     uint32_t n = *leaf_node_num_cells(leaf);
 
     if (c->cell_num >= n ||
@@ -1383,17 +1860,7 @@ bool btree_delete(Table *t, int32_t key, char *errbuf, uint32_t errbuf_sz) {
         return false;
     }
 
-    /* Shift cells left */
-    for (uint32_t i = c->cell_num + 1; i < n; i++) {
-        memmove(
-            leaf_node_cell(leaf, i - 1),
-            leaf_node_cell(leaf, i),
-            LEAF_NODE_CELL_SIZE
-        );
-    }
-
-    *leaf_node_num_cells(leaf) = n - 1;
-    t->header.num_rows--;
+    leaf_remove_cell(t, c->page_num, c->cell_num, key);
 
     /*
      * IMPORTANT:
@@ -1415,16 +1882,561 @@ bool btree_delete(Table *t, int32_t key, char *errbuf, uint32_t errbuf_sz) {
 }
 
 
+/* ============================================================
+ * In-place updates
+ *
+ * One descent finds the row; its leaf stays pinned while the callback
+ * looks at a copy of the row. Only if the callback asks for it is the
+ * leaf dirtied and the row written back over the same cell, so a
+ * declined compare-and-swap costs no write at all. The key is not the
+ * callback's to change.
+ * ============================================================ */
+
+bool btree_update_inplace(Table *t, int32_t key, BTreeUpdateFn fn, void *ctx,
+                          char *errbuf, uint32_t errbuf_sz) {
+    Cursor *c = btree_table_find(t, key);
+    uint32_t page = c->page_num;
+    uint32_t cell = c->cell_num;
+    btree_cursor_free(c);
+
+    void *leaf = pager_get_page(t->pager, page);
+    if (cell >= *leaf_node_num_cells(leaf) || (int32_t)*leaf_node_key(leaf, cell) != key) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "key not found");
+        return false;
+    }
+
+    pager_pin(t->pager, page);
+
+    Row row;
+    deserialize_row(leaf_node_value(leaf, cell), &row);
+    if (fn(&row, ctx)) {
+        row.id = key;
+        feed_replace(t, &row);
+        serialize_row(&row, leaf_node_value(get_node_mut(t, page), cell));
+    }
+
+    pager_unpin(t->pager, page);
+    return true;
+}
+
+/* Counters live in the username column as decimal text; empty reads as 0 */
+typedef struct {
+    int64_t delta;
+    int64_t value;
+    const char *error;  // why the row was left alone
+} IncrementCtx;
+
+static bool increment_row(Row *row, void *ctx) {
+    IncrementCtx *inc = ctx;
+    char *end = row->username;
+    errno = 0;
+    long long current = row->username[0] ? strtoll(row->username, &end, 10) : 0;
+
+    if (*end != '\0') {
+        inc->error = "value is not a counter";
+        return false;
+    }
+    if (errno == ERANGE ||
+        (inc->delta > 0 && current > INT64_MAX - inc->delta) ||
+        (inc->delta < 0 && current < INT64_MIN - inc->delta)) {
+        inc->error = "counter out of range";
+        return false;
+    }
+
+    inc->value = current + inc->delta;
+    snprintf(row->username, sizeof(row->username), "%lld", (long long)inc->value);
+    return true;
+}
+
+bool btree_increment(Table *t, int32_t key, int64_t delta, int64_t *value,
+                     char *errbuf, uint32_t errbuf_sz) {
+    IncrementCtx inc = { .delta = delta };
+    if (!btree_update_inplace(t, key, increment_row, &inc, errbuf, errbuf_sz)) return false;
+
+    if (inc.error) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "%s", inc.error);
+        return false;
+    }
+    if (value) *value = inc.value;
+    return true;
+}
+
+typedef struct {
+    const Row *expected;
+    const Row *desired;
+    bool swapped;
+} CasCtx;
+
+static bool cas_row(Row *row, void *ctx) {
+    CasCtx *cas = ctx;
+    cas->swapped = strcmp(row->username, cas->expected->username) == 0 &&
+                   strcmp(row->email, cas->expected->email) == 0;
+    if (!cas->swapped) return false;
+
+    memcpy(row->username, cas->desired->username, sizeof(row->username));
+    memcpy(row->email, cas->desired->email, sizeof(row->email));
+    return true;
+}
+
+bool btree_compare_and_swap(Table *t, int32_t key, const Row *expected, const Row *desired,
+                            bool *swapped, char *errbuf, uint32_t errbuf_sz) {
+    CasCtx cas = { .expected = expected, .desired = desired };
+    if (!btree_update_inplace(t, key, cas_row, &cas, errbuf, errbuf_sz)) return false;
+    if (swapped) *swapped = cas.swapped;
+    return true;
+}
+
+/* ============================================================
+ * Write batches
+ *
+ * Operations are appended to one growing array (the batch's arena) and
+ * applied together by btree_batch_apply:
+ *
+ *   1. sort by key, keeping arrival order within a key, and resolve
+ *      each key's operations against the tree into at most one: an
+ *      insert of a present key fails the batch, as a plain insert
+ *      would; a delete of an absent key does nothing; a delete then
+ *      insert of a present key becomes a replace
+ *   2. refuse the batch up front if its inserts could run out of pages,
+ *      so it is applied entirely or not at all
+ *   3. apply inserts and replaces, then deletes, each in key order:
+ *      consecutive keys mostly land in the leaf the finger already
+ *      points at, so descents are shared. No split runs after a delete,
+ *      so none ever meets a leaf that deletes emptied
+ *   4. deletes leave leaves underfull for the moment; underfull leaves
+ *      are rebalanced in one pass, after all operations
+ *
+ * Everything happens inside one statement, so shared readers, followers
+ * and the change feed see the batch as a single commit.
+ * ============================================================ */
+
+enum { BATCH_INSERT, BATCH_DELETE, BATCH_REPLACE };  // replace: only from resolving
+
+typedef struct {
+    uint8_t type;
+    uint32_t seq;   // arrival order, to replay repeated keys in order
+    Row row;        // only row.id for deletes
+} BatchOp;
+
+struct WriteBatch {
+    BatchOp *ops;
+    size_t count;
+    size_t cap;
+};
+
+WriteBatch *btree_batch_new(void) {
+    WriteBatch *b = calloc(1, sizeof(WriteBatch));
+    if (!b) die("calloc");
+    return b;
+}
+
+static BatchOp *batch_push(WriteBatch *b, uint8_t type) {
+    if (b->count == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 64;
+        b->ops = realloc(b->ops, b->cap * sizeof(BatchOp));
+        if (!b->ops) die("realloc");
+    }
+    BatchOp *op = &b->ops[b->count];
+    op->type = type;
+    op->seq = (uint32_t)b->count++;
+    return op;
+}
+
+void btree_batch_insert(WriteBatch *b, const Row *row) {
+    batch_push(b, BATCH_INSERT)->row = *row;
+}
+
+void btree_batch_delete(WriteBatch *b, int32_t key) {
+    BatchOp *op = batch_push(b, BATCH_DELETE);
+    memset(&op->row, 0, sizeof(Row));
+    op->row.id = key;
+}
+
+size_t btree_batch_count(const WriteBatch *b) { return b->count; }
+
+void btree_batch_clear(WriteBatch *b) { b->count = 0; }
+
+void btree_batch_free(WriteBatch *b) {
+    if (!b) return;
+    free(b->ops);
+    free(b);
+}
+
+static int batch_op_order(const void *a, const void *b) {
+    const BatchOp *x = a, *y = b;
+    if (x->row.id != y->row.id) return (x->row.id > y->row.id) - (x->row.id < y->row.id);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/*
+ * Rebalances every underfull leaf, walking the leaf chain. Borrows and
+ * merges move separators and unlink pages, so the walk restarts from the
+ * leftmost leaf after each fix; every fix adds a cell or removes a leaf,
+ * so this terminates.
+ */
+static void batch_fix_leaves(Table *t) {
+    bool fixed = true;
+    while (fixed) {
+        fixed = false;
+
+        Cursor *c = btree_table_start(t);
+        uint32_t page = c->page_num;
+        btree_cursor_free(c);
+
+        while (page != 0) {
+            void *leaf = pager_get_page(t->pager, page);
+            if (!is_node_root(leaf) && *leaf_node_num_cells(leaf) < LEAF_NODE_MIN_CELLS) {
+                rebalance_leaf(t, page);
+                fixed = true;
+                break;
+            }
+            page = *leaf_node_next_leaf(leaf);
+        }
+    }
+}
+
+/*
+ * Recomputes every separator below page from its child's max key. The
+ * batch's deletes leave separators stale, and a leaf that was empty when
+ * its parent was rebuilt got a separator of 0, which a later borrow into
+ * it does not correct. Only nodes holding a wrong key are dirtied.
+ */
+static void batch_fix_separators(Table *t, uint32_t page) {
+    void *node = pager_get_page(t->pager, page);
+    if (get_node_type(node) == NODE_LEAF) return;
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+    batch_fix_separators(t, *internal_node_right_child(node));
+    for (uint32_t i = 0; i < num_keys; i++) {
+        uint32_t child = *internal_node_child(node, i);
+        batch_fix_separators(t, child);
+
+        uint32_t key = get_node_max_key(t, child);
+        if (*internal_node_key(node, i) != key) *internal_node_key(get_node_mut(t, page), i) = key;
+    }
+}
+
+static bool key_present(Table *t, int32_t key) {
+    Cursor *c = btree_table_find(t, key);
+    void *leaf = pager_get_page(t->pager, c->page_num);
+    uint32_t cell = 0;
+    bool found = leaf_node_search(leaf, key, &cell);
+    btree_cursor_free(c);
+    return found;
+}
+
+/*
+ * Collapses the sorted ops of each key into the one operation with the
+ * same effect, replaying them in arrival order against the key's
+ * presence in the tree. Returns the number of ops left, or -1 with
+ * errbuf filled if an insert would hit a present key.
+ */
+static long batch_resolve(Table *t, WriteBatch *b, uint32_t *inserts, char *errbuf, uint32_t errbuf_sz) {
+    size_t n = 0;
+    *inserts = 0;
+    for (size_t i = 0; i < b->count;) {
+        int32_t key = b->ops[i].row.id;
+        bool existed = key_present(t, key);
+        bool exists = existed;
+        size_t last_insert = i;
+
+        size_t j = i;
+        for (; j < b->count && b->ops[j].row.id == key; j++) {
+            if (b->ops[j].type == BATCH_DELETE) {
+                exists = false;
+            } else if (exists) {
+                if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "duplicate key %d", key);
+                return -1;
+            } else {
+                exists = true;
+                last_insert = j;
+            }
+        }
+
+        if (exists) {
+            b->ops[n] = b->ops[last_insert];
+            b->ops[n].type = existed ? BATCH_REPLACE : BATCH_INSERT;
+            *inserts += !existed;
+            n++;
+        } else if (existed) {
+            b->ops[n] = b->ops[i];
+            b->ops[n].type = BATCH_DELETE;
+            n++;
+        }
+        i = j;
+    }
+    return (long)n;
+}
+
+/*
+ * Pages inserting `inserts` new keys may allocate. Every new page at one
+ * level can force a split of an existing node one level up. The root is
+ * a single node: after its first split, each further one needs
+ * INTERNAL_NODE_MIN_KEYS more children, and each split copies the old
+ * root into a new page under a new root, which grows the same way.
+ */
+static uint32_t batch_page_budget(Table *t, uint32_t inserts) {
+    uint32_t root_level = tree_depth(t) - 1;  // leaves are level 0
+    uint64_t need = 0;
+    uint64_t grow = inserts;  // new pages at the level being counted
+
+    for (uint32_t level = 0; grow > 0; level++) {
+        need += grow;
+        if (level + 1 < root_level) continue;
+        if (level + 1 == root_level) {
+            uint64_t root_splits = 1 + grow / INTERNAL_NODE_MIN_KEYS;
+            if (root_splits < grow) grow = root_splits;
+            continue;
+        }
+        // this level held the root; the level above is a new root's
+        need++;
+        grow = (grow + 2) / INTERNAL_NODE_MIN_KEYS;
+    }
+    return need > UINT32_MAX ? UINT32_MAX : (uint32_t)need;
+}
+
+bool btree_batch_apply(Table *t, WriteBatch *b, char *errbuf, uint32_t errbuf_sz) {
+    qsort(b->ops, b->count, sizeof(BatchOp), batch_op_order);
+
+    uint32_t inserts = 0;
+    long resolved = batch_resolve(t, b, &inserts, errbuf, errbuf_sz);
+    if (resolved < 0) {
+        b->count = 0;
+        return false;
+    }
+    size_t n = (size_t)resolved;
+
+    if (!pages_available(t, batch_page_budget(t, inserts))) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "batch too large for the free pages left");
+        b->count = 0;
+        return false;
+    }
+
+    bool underfull = false;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < n; i++) {
+            BatchOp *op = &b->ops[i];
+            if ((op->type == BATCH_DELETE) != (pass == 1)) continue;
+
+            Cursor *c = btree_table_find(t, op->row.id);
+            if (op->type == BATCH_REPLACE) {
+                void *leaf = get_node_mut(t, c->page_num);
+                feed_replace(t, &op->row);
+                serialize_row(&op->row, leaf_node_value(leaf, c->cell_num));
+            } else if (op->type == BATCH_INSERT) {
+                leaf_insert_row(t, c, &op->row);
+            } else {
+                leaf_remove_cell(t, c->page_num, c->cell_num, op->row.id);
+                void *leaf = pager_get_page(t->pager, c->page_num);
+                if (!is_node_root(leaf) && *leaf_node_num_cells(leaf) < LEAF_NODE_MIN_CELLS) {
+                    underfull = true;
+                }
+            }
+            btree_cursor_free(c);
+        }
+    }
+
+    // One round of structural fixes, after all operations
+    if (underfull) {
+        batch_fix_leaves(t);
+        batch_fix_separators(t, t->header.root_page_num);
+    }
+
+    b->count = 0;
+    return true;
+}
+
+/* ============================================================
+ * Structural integrity check
+ * - Walks the tree depth-first from the root, carrying the key range
+ *   each subtree must fall in (lower exclusive, upper inclusive).
+ * - Checks, per node: valid type, parent pointer, root flag, fill bounds,
+ *   sorted keys, keys within range.
+ * - A separator only has to bound its child's keys: deletes do not tighten
+ *   it, so it may sit above the child's current max key.
+ * - Checks, per tree: uniform leaf depth, no page reached twice, and a
+ *   next_leaf chain that visits the leaves in tree order.
+ * ============================================================ */
+
+typedef struct {
+    Table *t;
+    uint8_t *visited;        // one byte per page below next_free_page
+    uint32_t *leaves;        // leaves in tree (in-order) order
+    uint32_t num_leaves;
+    uint32_t leaf_depth;     // 0 until the first leaf is reached
+    BTreeCheckStats stats;
+    char *errbuf;
+    uint32_t errbuf_sz;
+} CheckContext;
+
+static bool check_fail(CheckContext *cx, uint32_t page, const char *what) {
+    if (cx->errbuf && cx->errbuf_sz)
+        snprintf(cx->errbuf, cx->errbuf_sz, "page %u: %s", page, what);
+    return false;
+}
+
+static bool check_node(
+    CheckContext *cx,
+    uint32_t page,
+    uint32_t parent_page,
+    uint32_t depth,
+    bool has_lower, int32_t lower,
+    bool has_upper, int32_t upper
+) {
+    Table *t = cx->t;
+
+    if (page == 0 || page >= t->header.next_free_page)
+        return check_fail(cx, page, "child pointer out of range");
+    if (cx->visited[page])
+        return check_fail(cx, page, "page reachable twice");
+    if (!page_in_use(t, page))
+        return check_fail(cx, page, "reachable page marked free");
+    cx->visited[page] = 1;
+
+    void *node = pager_get_page(t->pager, page);
+    bool root = (page == t->header.root_page_num);
+
+    if (get_node_format(node) > NODE_FORMAT_CURRENT)
+        return check_fail(cx, page, "unknown page format");
+    if (is_node_root(node) != root)
+        return check_fail(cx, page, "root flag mismatch");
+    if (!root && *node_parent(node) != parent_page)
+        return check_fail(cx, page, "wrong parent pointer");
+
+    if (get_node_type(node) == NODE_LEAF) {
+        uint32_t n = *leaf_node_num_cells(node);
+        if (n > LEAF_NODE_MAX_CELLS)
+            return check_fail(cx, page, "leaf overfull");
+        if (!root && n < LEAF_NODE_MIN_CELLS)
+            return check_fail(cx, page, "leaf underfull");
+
+        for (uint32_t i = 0; i < n; i++) {
+            int32_t key = (int32_t)*leaf_node_key(node, i);
+            if (i > 0 && key <= (int32_t)*leaf_node_key(node, i - 1))
+                return check_fail(cx, page, "leaf keys not sorted");
+            if ((has_lower && key <= lower) || (has_upper && key > upper))
+                return check_fail(cx, page, "leaf key outside separator range");
+        }
+
+        if (cx->leaf_depth == 0) cx->leaf_depth = depth;
+        if (depth != cx->leaf_depth)
+            return check_fail(cx, page, "leaves at different depths");
+
+        cx->leaves[cx->num_leaves++] = page;
+        cx->stats.leaf_pages++;
+        cx->stats.rows += n;
+        return true;
+    }
+
+    if (get_node_type(node) != NODE_INTERNAL)
+        return check_fail(cx, page, "unknown node type");
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (num_keys > INTERNAL_NODE_MAX_KEYS)
+        return check_fail(cx, page, "internal node overfull");
+    if (!root && num_keys < INTERNAL_NODE_MIN_KEYS)
+        return check_fail(cx, page, "internal node underfull");
+
+    cx->stats.internal_pages++;
+
+    bool child_has_lower = has_lower;
+    int32_t child_lower = lower;
+
+    for (uint32_t i = 0; i < num_keys; i++) {
+        int32_t key = (int32_t)*internal_node_key(node, i);
+        if (i > 0 && key <= (int32_t)*internal_node_key(node, i - 1))
+            return check_fail(cx, page, "internal keys not sorted");
+        if ((has_lower && key <= lower) || (has_upper && key > upper))
+            return check_fail(cx, page, "separator outside parent range");
+
+        uint32_t child = *internal_node_child(node, i);
+        if (!check_node(cx, child, page, depth + 1, child_has_lower, child_lower, true, key))
+            return false;
+
+        child_has_lower = true;
+        child_lower = key;
+    }
+
+    return check_node(cx, *internal_node_right_child(node), page, depth + 1,
+                      child_has_lower, child_lower, has_upper, upper);
+}
+
+bool btree_check(Table *t, BTreeCheckStats *stats, char *errbuf, uint32_t errbuf_sz) {
+    CheckContext cx = {0};
+    cx.t = t;
+    cx.errbuf = errbuf;
+    cx.errbuf_sz = errbuf_sz;
+    cx.visited = calloc(t->header.next_free_page, 1);
+    cx.leaves = calloc(t->header.next_free_page, sizeof(uint32_t));
+    if (!cx.visited || !cx.leaves) die("calloc");
+
+    bool ok = check_node(&cx, t->header.root_page_num, 0, 1, false, 0, false, 0);
+
+    /* The leaf chain must visit exactly the in-order leaves */
+    for (uint32_t i = 0; ok && i < cx.num_leaves; i++) {
+        void *leaf = pager_get_page(t->pager, cx.leaves[i]);
+        uint32_t expected = (i + 1 < cx.num_leaves) ? cx.leaves[i + 1] : 0;
+        if (*leaf_node_next_leaf(leaf) != expected)
+            ok = check_fail(&cx, cx.leaves[i], "next_leaf does not match tree order");
+    }
+
+    if (ok && cx.stats.rows != t->header.num_rows)
+        ok = check_fail(&cx, 0, "header num_rows does not match leaf cells");
+
+    cx.stats.depth = cx.leaf_depth;
+    if (stats) *stats = cx.stats;
+
+    free(cx.visited);
+    free(cx.leaves);
+    return ok;
+}
+
+/* ============================================================
+ * Background format upgrade
+ * - Sweeps pages in file order so the converter reads sequentially.
+ * - Examines at most max_pages per call; callers decide the pace.
+ * ============================================================ */
+
+bool btree_upgrade_step(Table *t, uint32_t max_pages, uint32_t *converted) {
+    if (t->upgrade_next_page == 0) t->upgrade_next_page = 1;  // page 0 is the DB header
+
+    for (uint32_t i = 0; i < max_pages; i++) {
+        if (t->upgrade_next_page >= t->header.next_free_page) return true;
+        if (!page_in_use(t, t->upgrade_next_page)) {
+            t->upgrade_next_page++;  // free extent slot: nothing to convert
+            continue;
+        }
+
+        void *node = pager_get_page(t->pager, t->upgrade_next_page);
+        if (node_upgrade(node)) {
+            pager_mark_dirty(t->pager, t->upgrade_next_page);
+            if (converted) (*converted)++;
+        }
+        t->upgrade_next_page++;
+    }
+
+    return t->upgrade_next_page >= t->header.next_free_page;
+}
+
 /* ============================================================
  * New DB init
  * ============================================================ */
 
 void btree_init_new_db(Table *t) {
+    t->header.magic = DB_MAGIC;
     t->header.num_rows = 0;
     t->header.root_page_num = 1;
-    t->header.next_free_page = 2;
+    t->header.extent_pages = BTREE_EXTENT_PAGES;
+    t->header.flags = DB_FLAG_CHECKSUMS;
+    t->pager->checksums_required = true;
 
-    void *root = pager_get_page(t->pager, t->header.root_page_num);
+    // Page 0 (header) and the root open the first extent
+    t->header.next_free_page = BTREE_EXTENT_PAGES < t->pager->max_pages ? BTREE_EXTENT_PAGES : t->pager->max_pages;
+    take_page(t, 0);
+    take_page(t, 1);
+
+    void *root = get_node_mut(t, t->header.root_page_num);
     initialize_leaf_node(root);
     set_node_root(root, true);
 }
@@ -0,0 +1,357 @@
+#include "bulk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Bytes read per fread() */
+#define IMPORT_BLOCK_SIZE (1u << 20)
+
+/* Rows sorted and inserted together; consecutive keys land on the same leaf */
+#define IMPORT_BATCH_ROWS 4096
+
+/* stdio buffer for exports, so rows reach the disk in large writes */
+#define EXPORT_BUFFER_SIZE (1u << 20)
+
+/* Rows taken from the cursor per btree_cursor_next_batch call */
+#define EXPORT_SCAN_BATCH 256
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+/* ============================================================
+ * CSV parsing
+ * ============================================================ */
+
+static bool parse_int32(const char *s, size_t len, int32_t *out) {
+    size_t i = 0;
+    bool neg = false;
+    if (len > 0 && (s[0] == '-' || s[0] == '+')) {
+        neg = (s[0] == '-');
+        i = 1;
+    }
+    if (i == len) return false;
+
+    int64_t v = 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return false;
+        v = v * 10 + (s[i] - '0');
+        if (v > (int64_t)INT32_MAX + 1) return false;
+    }
+    if (neg) v = -v;
+    if (v < INT32_MIN || v > INT32_MAX) return false;
+
+    *out = (int32_t)v;
+    return true;
+}
+
+/*
+ * csv_field - Copy one field starting at s into dst (cap bytes plus NUL)
+ *
+ * A field in double quotes may hold commas, newlines and doubled quotes
+ * (RFC 4180). An unquoted field ends at the next comma, found with
+ * memchr, which libc implements with vector instructions; the last
+ * field runs to the end of the line. Returns where the field stopped
+ * (its comma or end), or NULL for an empty, oversized or malformed field.
+ */
+static const char *csv_field(const char *s, const char *end, char *dst, size_t cap, bool last) {
+    size_t n = 0;
+    if (s < end && *s == '"') {
+        for (s++; ; s++) {
+            if (s == end) return NULL;
+            if (*s == '"') {
+                if (s + 1 == end || s[1] != '"') break;
+                s++;
+            }
+            if (n == cap) return NULL;
+            dst[n++] = *s;
+        }
+        s++;  // closing quote
+        if (s < end && *s != ',') return NULL;
+    } else {
+        const char *stop = last ? end : memchr(s, ',', (size_t)(end - s));
+        if (!stop) return NULL;
+        n = (size_t)(stop - s);
+        if (n > cap) return NULL;
+        memcpy(dst, s, n);
+        s = stop;
+    }
+    if (n == 0) return NULL;
+    dst[n] = '\0';
+    return s;
+}
+
+/* parse_csv_line - Split one line into a Row */
+static bool parse_csv_line(const char *line, size_t len, Row *row) {
+    if (len > 0 && line[len - 1] == '\r') len--;
+
+    const char *end = line + len;
+    char id[16];
+
+    memset(row, 0, sizeof(Row));
+    const char *p = csv_field(line, end, id, sizeof(id) - 1, false);
+    if (!p || p == end) return false;
+    p = csv_field(p + 1, end, row->username, COLUMN_USERNAME_SIZE, false);
+    if (!p || p == end) return false;
+    p = csv_field(p + 1, end, row->email, COLUMN_EMAIL_SIZE, true);
+    return p == end && parse_int32(id, strlen(id), &row->id);
+}
+
+/* End of the line starting at p: the first newline outside quotes, or NULL */
+static char *find_line_end(char *p, char *end) {
+    bool quoted = false;
+    for (;;) {
+        char *nl = memchr(p, '\n', (size_t)(end - p));
+        if (!nl) return NULL;
+        for (char *q = memchr(p, '"', (size_t)(nl - p)); q; q = memchr(q + 1, '"', (size_t)(nl - q - 1))) {
+            quoted = !quoted;
+        }
+        if (!quoted) return nl;
+        p = nl + 1;
+    }
+}
+
+/* ============================================================
+ * Sorted batch insert
+ * ============================================================ */
+
+static int compare_row_id(const void *a, const void *b) {
+    int32_t x = ((const Row *)a)->id;
+    int32_t y = ((const Row *)b)->id;
+    return (x > y) - (x < y);
+}
+
+/* Inserts the batch; false (with errbuf filled) once the database is full */
+static bool flush_batch(Table *t, Row *batch, uint32_t *count, uint64_t *imported, uint64_t *rejected,
+                        char *errbuf, uint32_t errbuf_sz) {
+    qsort(batch, *count, sizeof(Row), compare_row_id);
+
+    for (uint32_t i = 0; i < *count; i++) {
+        char err[64] = {0};
+        if (btree_insert(t, &batch[i], err, sizeof(err))) {
+            (*imported)++;
+        } else if (strcmp(err, "duplicate key") == 0) {
+            (*rejected)++;
+        } else {
+            if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "%s", err);
+            *count = 0;
+            return false;
+        }
+    }
+    *count = 0;
+    return true;
+}
+
+bool bulk_import_csv(Table *t, const char *filename,
+                     uint64_t *imported, uint64_t *rejected,
+                     char *errbuf, uint32_t errbuf_sz) {
+    *imported = 0;
+    *rejected = 0;
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "cannot open %s", filename);
+        return false;
+    }
+
+    char *buf = malloc(IMPORT_BLOCK_SIZE);
+    Row *batch = malloc(sizeof(Row) * IMPORT_BATCH_ROWS);
+    if (!buf || !batch) die("malloc");
+
+    uint32_t batch_count = 0;
+    size_t have = 0;  // bytes carried over from the previous block (a partial line)
+    bool eof = false;
+    bool ok = true;
+
+    while (!eof) {
+        size_t nread = fread(buf + have, 1, IMPORT_BLOCK_SIZE - have, f);
+        if (nread < IMPORT_BLOCK_SIZE - have) {
+            if (ferror(f)) die("fread");
+            eof = true;
+        }
+        have += nread;
+
+        // Split the block at newline boundaries
+        char *p = buf;
+        char *end = buf + have;
+        while (p < end) {
+            char *nl = find_line_end(p, end);
+            if (!nl) {
+                if (!eof) break;   // keep the partial line for the next block
+                nl = end;          // last line without a trailing newline
+            }
+
+            size_t len = (size_t)(nl - p);
+            if (len > 0 && !(len == 1 && p[0] == '\r')) {
+                if (parse_csv_line(p, len, &batch[batch_count])) {
+                    if (++batch_count == IMPORT_BATCH_ROWS &&
+                        !flush_batch(t, batch, &batch_count, imported, rejected, errbuf, errbuf_sz)) {
+                        ok = false;
+                        break;
+                    }
+                } else {
+                    (*rejected)++;
+                }
+            }
+            p = nl + 1;
+        }
+
+        if (!ok) break;
+
+        if (p < end) {
+            have = (size_t)(end - p);
+            if (have == IMPORT_BLOCK_SIZE) {
+                if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "line longer than %u bytes", IMPORT_BLOCK_SIZE);
+                ok = false;
+                break;
+            }
+            memmove(buf, p, have);
+        } else {
+            have = 0;
+        }
+    }
+
+    // Rows parsed before an oversized line still go in, like the batches before them
+    if (batch_count > 0) {
+        char err[128] = {0};
+        if (!flush_batch(t, batch, &batch_count, imported, rejected, err, sizeof(err)) && ok) {
+            if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "%s", err);
+            ok = false;
+        }
+    }
+
+    free(batch);
+    free(buf);
+    fclose(f);
+    return ok;
+}
+
+/* ============================================================
+ * Export
+ * ============================================================ */
+
+/* Column buffers for one binary block */
+typedef struct {
+    uint32_t nrows;
+    uint8_t *ids;
+    uint8_t *users;
+    uint8_t *emails;
+    uint32_t users_len;
+    uint32_t emails_len;
+} ExportBlock;
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void write_u32(FILE *f, uint32_t v) {
+    uint8_t b[4];
+    put_u32(b, v);
+    if (fwrite(b, sizeof(b), 1, f) != 1) die("fwrite");
+}
+
+/* Quotes a field holding a delimiter, quote or line break (RFC 4180) */
+static void write_csv_field(FILE *f, const char *s) {
+    if (!strpbrk(s, ",\"\r\n")) {
+        if (fputs(s, f) == EOF) die("fputs");
+        return;
+    }
+    if (putc('"', f) == EOF) die("putc");
+    for (; *s; s++) {
+        if (*s == '"' && putc('"', f) == EOF) die("putc");
+        if (putc(*s, f) == EOF) die("putc");
+    }
+    if (putc('"', f) == EOF) die("putc");
+}
+
+static void write_column(FILE *f, const uint8_t *data, uint32_t len) {
+    write_u32(f, len);
+    if (len && fwrite(data, len, 1, f) != 1) die("fwrite");
+}
+
+static void block_add(ExportBlock *blk, const RowView *row) {
+    put_u32(blk->ids + blk->nrows * 4, (uint32_t)row->id);
+
+    size_t ulen = strlen(row->username);
+    blk->users[blk->users_len++] = (uint8_t)ulen;
+    memcpy(blk->users + blk->users_len, row->username, ulen);
+    blk->users_len += (uint32_t)ulen;
+
+    size_t elen = strlen(row->email);
+    blk->emails[blk->emails_len++] = (uint8_t)elen;
+    blk->emails[blk->emails_len++] = (uint8_t)(elen >> 8);
+    memcpy(blk->emails + blk->emails_len, row->email, elen);
+    blk->emails_len += (uint32_t)elen;
+
+    blk->nrows++;
+}
+
+static void block_flush(FILE *f, ExportBlock *blk) {
+    if (blk->nrows == 0) return;
+
+    write_u32(f, blk->nrows);
+    write_column(f, blk->ids, blk->nrows * 4);
+    write_column(f, blk->users, blk->users_len);
+    write_column(f, blk->emails, blk->emails_len);
+
+    blk->nrows = 0;
+    blk->users_len = 0;
+    blk->emails_len = 0;
+}
+
+bool bulk_export(Table *t, const char *filename, ExportFormat format,
+                 uint64_t *exported, char *errbuf, uint32_t errbuf_sz) {
+    *exported = 0;
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "cannot open %s", filename);
+        return false;
+    }
+    if (setvbuf(f, NULL, _IOFBF, EXPORT_BUFFER_SIZE) != 0) die("setvbuf");
+
+    ExportBlock blk = {0};
+    if (format == EXPORT_BINARY) {
+        blk.ids = malloc((size_t)EXPORT_BLOCK_ROWS * 4);
+        blk.users = malloc((size_t)EXPORT_BLOCK_ROWS * (1 + COLUMN_USERNAME_SIZE));
+        blk.emails = malloc((size_t)EXPORT_BLOCK_ROWS * (2 + COLUMN_EMAIL_SIZE));
+        if (!blk.ids || !blk.users || !blk.emails) die("malloc");
+        if (fwrite(EXPORT_MAGIC, strlen(EXPORT_MAGIC), 1, f) != 1) die("fwrite");
+    }
+
+    RowView rows[EXPORT_SCAN_BATCH];
+    Cursor *c = btree_table_start(t);
+
+    size_t n;
+    while ((n = btree_cursor_next_batch(c, rows, EXPORT_SCAN_BATCH)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (format == EXPORT_CSV) {
+                if (fprintf(f, "%d,", rows[i].id) < 0) die("fprintf");
+                write_csv_field(f, rows[i].username);
+                if (putc(',', f) == EOF) die("putc");
+                write_csv_field(f, rows[i].email);
+                if (putc('\n', f) == EOF) die("putc");
+            } else {
+                block_add(&blk, &rows[i]);
+                if (blk.nrows == EXPORT_BLOCK_ROWS) block_flush(f, &blk);
+            }
+        }
+        *exported += n;
+    }
+    btree_cursor_free(c);
+
+    if (format == EXPORT_BINARY) {
+        block_flush(f, &blk);
+        write_u32(f, 0);
+        free(blk.ids);
+        free(blk.users);
+        free(blk.emails);
+    }
+
+    if (fclose(f) != 0) die("fclose");
+    return true;
+}
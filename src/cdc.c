@@ -0,0 +1,122 @@
+#include "cdc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct ChangeFeed {
+    FILE *file;
+    uint8_t *buf;
+    uint32_t used;
+    uint64_t last_flush_ms;
+};
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+ChangeFeed *cdc_open(const char *filename) {
+    FILE *f = fopen(filename, "ab");
+    if (!f) return NULL;
+
+    ChangeFeed *feed = calloc(1, sizeof(ChangeFeed));
+    if (!feed) die("calloc");
+    feed->buf = malloc(CDC_BUFFER_SIZE);
+    if (!feed->buf) die("malloc");
+
+    feed->file = f;
+    feed->last_flush_ms = now_ms();
+    return feed;
+}
+
+static void cdc_flush(ChangeFeed *feed) {
+    if (feed->used > 0) {
+        if (fwrite(feed->buf, feed->used, 1, feed->file) != 1) die("fwrite");
+        if (fflush(feed->file) != 0) die("fflush");
+        feed->used = 0;
+    }
+    feed->last_flush_ms = now_ms();
+}
+
+void cdc_append(ChangeFeed *feed, uint8_t op, const Row *row) {
+    uint8_t ulen = 0;
+    uint16_t elen = 0;
+    if (op == CDC_OP_INSERT) {
+        ulen = (uint8_t)strlen(row->username);
+        elen = (uint16_t)strlen(row->email);
+    }
+
+    uint32_t len = CDC_RECORD_HEADER_SIZE + ulen + elen;
+    if (feed->used + len > CDC_BUFFER_SIZE) cdc_flush(feed);
+
+    uint8_t *p = feed->buf + feed->used;
+    memcpy(p, &len, 4);
+    p[4] = op;
+    p[5] = ulen;
+    memcpy(p + 6, &elen, 2);
+    memcpy(p + 8, &row->id, 4);
+    memcpy(p + CDC_RECORD_HEADER_SIZE, row->username, ulen);
+    memcpy(p + CDC_RECORD_HEADER_SIZE + ulen, row->email, elen);
+    feed->used += len;
+}
+
+void cdc_tick(ChangeFeed *feed) {
+    if (feed->used == 0) return;
+    if (now_ms() - feed->last_flush_ms >= CDC_FLUSH_INTERVAL_MS) cdc_flush(feed);
+}
+
+void cdc_close(ChangeFeed *feed) {
+    if (!feed) return;
+    cdc_flush(feed);
+    if (fclose(feed->file) != 0) die("fclose");
+    free(feed->buf);
+    free(feed);
+}
+
+/* ============================================================
+ * Consumer
+ * ============================================================ */
+
+uint64_t cdc_read(const char *filename, uint64_t offset, CdcCallback fn, void *ctx) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return offset;
+    if (fseek(f, (long)offset, SEEK_SET) != 0) {
+        fclose(f);
+        return offset;
+    }
+
+    uint8_t rec[CDC_RECORD_HEADER_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE];
+    while (fread(rec, CDC_RECORD_HEADER_SIZE, 1, f) == 1) {
+        uint32_t len;
+        uint16_t elen;
+        memcpy(&len, rec, 4);
+        memcpy(&elen, rec + 6, 2);
+        uint8_t ulen = rec[5];
+
+        if (len != (uint32_t)CDC_RECORD_HEADER_SIZE + ulen + elen ||
+            ulen > COLUMN_USERNAME_SIZE || elen > COLUMN_EMAIL_SIZE) {
+            break;  // torn or foreign data: stop here
+        }
+        if (ulen + elen > 0 && fread(rec + CDC_RECORD_HEADER_SIZE, ulen + elen, 1, f) != 1) break;
+
+        CdcRecord r;
+        memset(&r, 0, sizeof(r));
+        r.op = rec[4];
+        memcpy(&r.row.id, rec + 8, 4);
+        memcpy(r.row.username, rec + CDC_RECORD_HEADER_SIZE, ulen);
+        memcpy(r.row.email, rec + CDC_RECORD_HEADER_SIZE + ulen, elen);
+
+        fn(&r, offset, ctx);
+        offset += len;
+    }
+
+    fclose(f);
+    return offset;
+}
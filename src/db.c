@@ -1,7 +1,15 @@
 #include "db.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Page 0 layout: DBHeader at 0, then the pager change bitmap and the allocator's page map */
+#define DB_CHANGE_MAP_OFFSET 64
+#define DB_PAGE_MAP_OFFSET   (DB_CHANGE_MAP_OFFSET + PAGER_CHANGE_MAP_SIZE)
+
+_Static_assert(sizeof(DBHeader) <= DB_CHANGE_MAP_OFFSET, "DBHeader overlaps change map");
+_Static_assert(DB_PAGE_MAP_OFFSET + PAGER_CHANGE_MAP_SIZE <= PAGE_USABLE_SIZE, "page map past page end");
+
 static void die(const char *msg) {
     perror(msg);
     exit(1);
@@ -13,31 +21,250 @@ Table *db_open(const char *filename) {
     if (!t) die("calloc");
 
     t->pager = p;
+    p->keep_resident = btree_page_is_internal;
 
     if (p->num_pages == 0) {
         btree_init_new_db(t);
     } else {
-        // read header from page 0
-        void *page0 = pager_get_page(p, 0);
-        memcpy(&t->header, page0, sizeof(DBHeader));
-
-        // basic sanity
-        if (t->header.root_page_num == 0 || t->header.root_page_num >= TABLE_MAX_PAGES) {
-            die("invalid header/root; delete db");
-        }
-        if (t->header.next_free_page == 0 || t->header.next_free_page >= TABLE_MAX_PAGES) {
-            die("invalid next_free_page; delete db");
-        }
+        db_reload_header(t);
     }
 
     return t;
 }
 
-void db_close(Table *t) {
-    // write header to page 0
+static Table *db_attach_readonly(Pager *p, bool load_header) {
+    if (!p) return NULL;
+
+    Table *t = calloc(1, sizeof(Table));
+    if (!t) die("calloc");
+
+    t->pager = p;
+    p->keep_resident = btree_page_is_internal;
+    if (load_header) db_reload_header(t);
+    return t;
+}
+
+/* A live writer may be publishing: shm_attach reads the header under the table latch */
+Table *db_open_mapped(const char *filename) {
+    return db_attach_readonly(pager_open_mapped(filename), false);
+}
+
+Table *db_open_readonly(const char *filename, bool use_map) {
+    return db_attach_readonly(pager_open_readonly(filename, use_map), true);
+}
+
+/*
+ * Open cost is one read of page 0 and a check of the header and page
+ * map, whatever the file size. Everything else is loaded on first use:
+ * tree pages by the pager, the change map by load_change_map.
+ */
+void db_reload_header(Table *t) {
+    // read header from page 0
     void *page0 = pager_get_page(t->pager, 0);
+    memcpy(&t->header, page0, sizeof(DBHeader));
+
+    if (t->header.magic != DB_MAGIC) {
+        if (t->header.magic != 0) die("not a tinydb database");
+        t->header.magic = DB_MAGIC;  // pre-magic file: stamped on the next header write
+    }
+
+    // older files may still hold pages written without a trailer
+    t->pager->checksums_required = (t->header.flags & DB_FLAG_CHECKSUMS) != 0;
+
+    // basic sanity
+    if (t->header.root_page_num == 0 || t->header.root_page_num >= t->pager->max_pages) {
+        die("invalid header/root; delete db");
+    }
+    if (t->header.next_free_page == 0 || t->header.next_free_page > t->pager->max_pages) {
+        die("invalid next_free_page; delete db");
+    }
+
+    // page map of the pages in use; a bump-allocated file used every page below the cursor
+    if (t->page_map_size < PAGER_CHANGE_MAP_SIZE) {
+        free(t->page_map);
+        t->page_map = malloc(PAGER_CHANGE_MAP_SIZE);
+        if (!t->page_map) die("malloc");
+        t->page_map_size = PAGER_CHANGE_MAP_SIZE;
+    }
+    memset(t->page_map, 0, t->page_map_size);
+    if (t->header.extent_pages != 0) {
+        memcpy(t->page_map, (uint8_t *)page0 + DB_PAGE_MAP_OFFSET, PAGER_CHANGE_MAP_SIZE);
+    } else {
+        for (uint32_t p = 0; p < t->header.next_free_page; p++) t->page_map[p / 8] |= (uint8_t)(1u << (p % 8));
+        t->header.extent_pages = BTREE_EXTENT_PAGES;
+    }
+
+    // page 0 may carry a different map now; read it again when needed
+    memset(t->pager->changed_map, 0, PAGER_CHANGE_MAP_SIZE);
+    t->change_map_loaded = false;
+
+    // the tree may have been reshaped underneath us
+    t->finger_page = 0;
+}
+
+/* Only header writes and backups need the stored map; readers never do */
+static void load_change_map(Table *t) {
+    if (t->change_map_loaded) return;
+
+    // merge, not copy: pages dirtied before the load belong in the map too
+    const uint8_t *map = (const uint8_t *)pager_get_page(t->pager, 0) + DB_CHANGE_MAP_OFFSET;
+    for (uint32_t i = 0; i < PAGER_CHANGE_MAP_SIZE; i++) t->pager->changed_map[i] |= map[i];
+    t->change_map_loaded = true;
+}
+
+/* Copy the in-memory header and both maps into page 0, dirtying it only if they changed */
+void db_sync_header(Table *t) {
+    load_change_map(t);
+    uint8_t *page0 = pager_get_page(t->pager, 0);
+    uint8_t *map = page0 + DB_CHANGE_MAP_OFFSET;
+    uint8_t *page_map = page0 + DB_PAGE_MAP_OFFSET;
+
+    if (memcmp(page0, &t->header, sizeof(DBHeader)) == 0 &&
+        memcmp(map, t->pager->changed_map, PAGER_CHANGE_MAP_SIZE) == 0 &&
+        memcmp(page_map, t->page_map, PAGER_CHANGE_MAP_SIZE) == 0) {
+        return;
+    }
+
+    // mark first: it sets page 0's own bit, which the stored map must include
+    pager_mark_dirty(t->pager, 0);
     memcpy(page0, &t->header, sizeof(DBHeader));
+    memcpy(map, t->pager->changed_map, PAGER_CHANGE_MAP_SIZE);
+    memcpy(page_map, t->page_map, PAGER_CHANGE_MAP_SIZE);  // an in-memory table may hold more
+}
+
+void db_close(Table *t) {
+    // write header to page 0
+    if (!t->pager->read_only) db_sync_header(t);
 
     pager_close(t->pager);
+    free(t->page_map);
     free(t);
 }
+
+PagerBackup *db_backup_begin(Table *t, const char *dest_filename, bool incremental,
+                             char *errbuf, uint32_t errbuf_sz) {
+    if (incremental && t->header.backup_gen == 0) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "no previous backup to build on");
+        return NULL;
+    }
+    // An in-memory database may outgrow what a file (or its change map) can hold
+    if (t->pager->num_pages > PAGER_FILE_MAX_PAGES) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "database too large for a file backup");
+        return NULL;
+    }
+
+    // Pages changed since the last backup; the header page always goes along
+    load_change_map(t);
+    uint8_t pages[PAGER_CHANGE_MAP_SIZE];
+    memcpy(pages, t->pager->changed_map, sizeof(pages));
+    pages[0] |= 1;
+
+    PagerBackup *b = pager_backup_begin(t->pager, dest_filename, incremental ? pages : NULL);
+    if (!b) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "cannot open %s", dest_filename);
+        return NULL;
+    }
+
+    // Start the next generation; changes from here on belong to the next backup
+    t->header.backup_gen++;
+    memset(t->pager->changed_map, 0, PAGER_CHANGE_MAP_SIZE);
+    db_sync_header(t);
+    return b;
+}
+
+bool db_backup_step(Table *t, PagerBackup *b, uint32_t max_pages) {
+    // the header only reaches page 0 here, so the backup picks up its latest state
+    db_sync_header(t);
+    return pager_backup_step(b, max_pages);
+}
+
+bool db_backup_finish(Table *t, PagerBackup *b, char *errbuf, uint32_t errbuf_sz) {
+    while (!db_backup_step(t, b, 64)) {}
+    if (!pager_backup_close(b)) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "backup could not be written to disk");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * db_restore_incremental - Roll a base copy forward by one page log
+ *
+ * The log's header page carries the generation it was taken at; it only
+ * applies to a base exactly one generation older. The whole log is
+ * validated before the base is touched.
+ */
+bool db_restore_incremental(const char *base_filename, const char *log_filename,
+                            char *errbuf, uint32_t errbuf_sz) {
+    FILE *log = pager_log_open(log_filename);
+    if (!log) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "%s is not a page log", log_filename);
+        return false;
+    }
+
+    uint8_t *page = malloc(PAGE_SIZE);
+    if (!page) die("malloc");
+
+    // Pass 1: validate records and read the log's generation
+    DBHeader log_header = {0};
+    uint32_t page_num = 0;
+    uint32_t records = 0;
+    int rc;
+    while ((rc = pager_log_next(log, &page_num, page)) == 1) {
+        if (records == 0 && page_num != 0) break;
+        if (records == 0) memcpy(&log_header, page, sizeof(DBHeader));
+        if (!pager_checksum_ok(page, (log_header.flags & DB_FLAG_CHECKSUMS) != 0)) {
+            rc = -1;
+            break;
+        }
+        records++;
+    }
+    if (rc != 0 || records == 0) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "corrupt page log");
+        free(page);
+        fclose(log);
+        return false;
+    }
+
+    FILE *probe = fopen(base_filename, "rb");
+    if (!probe) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "cannot open %s", base_filename);
+        free(page);
+        fclose(log);
+        return false;
+    }
+    fclose(probe);
+
+    // Readers or a writer of the base would see it change underneath them
+    Pager *p = pager_try_open(base_filename);
+    if (!p) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "%s is in use", base_filename);
+        free(page);
+        fclose(log);
+        return false;
+    }
+
+    DBHeader base_header;
+    memcpy(&base_header, pager_get_page(p, 0), sizeof(DBHeader));
+
+    if (log_header.backup_gen != base_header.backup_gen + 1) {
+        if (errbuf && errbuf_sz)
+            snprintf(errbuf, errbuf_sz, "base is generation %u, log needs %u",
+                     base_header.backup_gen, log_header.backup_gen - 1);
+        pager_close(p);
+        free(page);
+        fclose(log);
+        return false;
+    }
+
+    // Pass 2: apply, later records win
+    if (fseek(log, PAGER_LOG_MAGIC_SIZE, SEEK_SET) != 0) die("fseek");
+    while (pager_log_next(log, &page_num, page) == 1) {
+        pager_put_page(p, page_num, page);
+    }
+
+    pager_close(p);
+    free(page);
+    fclose(log);
+    return true;
+}
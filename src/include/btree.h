@@ -5,7 +5,10 @@
 #include <stdbool.h>
 #include "pager.h"
 
-#define TABLE_MAX_PAGES 256
+#define TABLE_MAX_PAGES PAGER_FILE_MAX_PAGES
+
+/* Pages reserved at a time by the allocator; leaves split within their extent */
+#define BTREE_EXTENT_PAGES 16
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -21,15 +24,33 @@ typedef enum {
     NODE_LEAF = 1
 } NodeType;
 
+/* "TDB1" little-endian; files from before the magic have 0 and get it on the next header write */
+#define DB_MAGIC 0x31424454u
+
+/* DBHeader.flags */
+#define DB_FLAG_CHECKSUMS 0x1u  // created with checksums: no page may lack its trailer
+
 typedef struct {
     uint32_t num_rows;       // informational
     uint32_t root_page_num;  // root page
-    uint32_t next_free_page; // allocator cursor
+    uint32_t next_free_page; // end of the pages reserved by the allocator
+    uint32_t backup_gen;     // generation of the newest backup taken (0 = none)
+    uint32_t magic;          // DB_MAGIC
+    uint32_t extent_pages;   // BTREE_EXTENT_PAGES; 0 = bump-allocated file, no page map
+    uint32_t flags;          // DB_FLAG_*
 } DBHeader;
 
+struct ChangeFeed;
+
 typedef struct {
     Pager *pager;
     DBHeader header;
+    uint32_t upgrade_next_page; // background format converter cursor
+    struct ChangeFeed *cdc;     // optional change data capture sink
+    uint32_t finger_page;       // leaf of the last descent, tried first (0 = none)
+    bool change_map_loaded;     // page 0's change map merged into the pager's
+    uint8_t *page_map;          // one bit per page in use below next_free_page
+    uint32_t page_map_size;     // bytes, at least PAGER_CHANGE_MAP_SIZE
 } Table;
 
 /* Cursor points to a leaf cell */
@@ -38,8 +59,19 @@ typedef struct {
     uint32_t page_num;
     uint32_t cell_num;
     bool end_of_table;
+    uint32_t leaf_hops;   // next-leaf steps taken; a long walk reads as a scan
+    uint32_t *pinned;     // leaves backing the last batch's RowViews
+    uint32_t num_pinned;
+    uint32_t pinned_cap;
 } Cursor;
 
+/* A row read in place from its leaf; valid until the next batch or btree_cursor_free */
+typedef struct {
+    int32_t id;
+    const char *username;
+    const char *email;
+} RowView;
+
 /* Open helpers */
 void btree_init_new_db(Table *t);
 
@@ -49,12 +81,72 @@ void    btree_cursor_advance(Cursor *c);
 void   *btree_cursor_value(Cursor *c);
 void    btree_cursor_free(Cursor *c);
 
+/* Up to max rows from the cursor on, across leaves, with their pages pinned
+ * until the next call. Returns the number of rows; 0 at the end of the table. */
+size_t  btree_cursor_next_batch(Cursor *c, RowView *out, size_t max);
+
 /* Find/Insert/Delete */
 Cursor *btree_table_find(Table *t, int32_t key);
 bool    btree_insert(Table *t, const Row *row, char *errbuf, uint32_t errbuf_sz);
 bool    btree_delete(Table *t, int32_t key, char *errbuf, uint32_t errbuf_sz);
 
+/*
+ * Read-modify-write in one descent. fn gets a copy of the row and returns
+ * true to have it written back in place (its id is kept). Fails only if
+ * the key is absent.
+ */
+typedef bool (*BTreeUpdateFn)(Row *row, void *ctx);
+bool    btree_update_inplace(Table *t, int32_t key, BTreeUpdateFn fn, void *ctx,
+                             char *errbuf, uint32_t errbuf_sz);
+
+/* Adds delta to the decimal counter held in the username column */
+bool    btree_increment(Table *t, int32_t key, int64_t delta, int64_t *value,
+                        char *errbuf, uint32_t errbuf_sz);
+
+/* Replaces username and email only if both still equal expected's */
+bool    btree_compare_and_swap(Table *t, int32_t key, const Row *expected, const Row *desired,
+                               bool *swapped, char *errbuf, uint32_t errbuf_sz);
+
+/*
+ * Write batches: inserts and deletes collected and applied together in
+ * key order, all or nothing. Replayed in order, an insert of a key that
+ * is present fails the whole batch, as a plain insert fails; deleting an
+ * absent key does nothing. Apply always empties the batch.
+ */
+typedef struct WriteBatch WriteBatch;
+
+WriteBatch *btree_batch_new(void);
+void        btree_batch_insert(WriteBatch *b, const Row *row);
+void        btree_batch_delete(WriteBatch *b, int32_t key);
+size_t      btree_batch_count(const WriteBatch *b);
+void        btree_batch_clear(WriteBatch *b);
+void        btree_batch_free(WriteBatch *b);
+bool        btree_batch_apply(Table *t, WriteBatch *b, char *errbuf, uint32_t errbuf_sz);
+
+/* Multi-get: calls fn once per distinct key, in key order, with row NULL for
+ * absent keys. One walk of the tree; each leaf is read once. */
+typedef void (*BTreeFindFn)(int32_t key, const Row *row, void *ctx);
+void    btree_find_many(Table *t, const int32_t *keys, size_t n, BTreeFindFn fn, void *ctx);
+
+/* Page format upgrade: converts legacy pages, examining at most max_pages.
+ * Returns true once every page has been examined. */
+bool    btree_upgrade_step(Table *t, uint32_t max_pages, uint32_t *converted);
+
 /* Debug/Introspection */
 void    btree_print(Table *t);
 
+/* Cache tiering: internal nodes stay resident (Pager.keep_resident) */
+bool    btree_page_is_internal(const void *page);
+
+typedef struct {
+    uint32_t depth;          // levels, leaves included
+    uint32_t internal_pages;
+    uint32_t leaf_pages;
+    uint32_t rows;
+} BTreeCheckStats;
+
+/* Verifies every structural invariant of the tree.
+ * Returns false and describes the first violation in errbuf. */
+bool    btree_check(Table *t, BTreeCheckStats *stats, char *errbuf, uint32_t errbuf_sz);
+
 #endif
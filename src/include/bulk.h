@@ -0,0 +1,44 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "btree.h"
+
+/*
+ * Bulk loading: CSV lines of "id,username,email"; fields may be quoted
+ * as in RFC 4180, which is how the CSV export writes any field holding
+ * a comma, quote or line break.
+ * Rows are parsed from large blocks and inserted in sorted batches.
+ * Malformed lines and duplicate ids are counted in *rejected.
+ * On failure (database full, oversized line) the rows counted in
+ * *imported stay inserted.
+ */
+bool bulk_import_csv(Table *t, const char *filename,
+                     uint64_t *imported, uint64_t *rejected,
+                     char *errbuf, uint32_t errbuf_sz);
+
+typedef enum {
+    EXPORT_CSV,
+    EXPORT_BINARY
+} ExportFormat;
+
+/*
+ * Binary export format (all integers little-endian):
+ *   magic "TDBCOL01"
+ *   blocks of up to EXPORT_BLOCK_ROWS rows, each:
+ *     u32 nrows
+ *     u32 size, then nrows x i32 id
+ *     u32 size, then nrows x [u8 len][len bytes]    username
+ *     u32 size, then nrows x [u16 len][len bytes]   email
+ *   a final block with nrows == 0
+ * The column sizes let a loader skip columns it does not need.
+ */
+#define EXPORT_MAGIC      "TDBCOL01"
+#define EXPORT_BLOCK_ROWS 4096
+
+/* Streams every row in key order; memory use does not depend on table size */
+bool bulk_export(Table *t, const char *filename, ExportFormat format,
+                 uint64_t *exported, char *errbuf, uint32_t errbuf_sz);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "btree.h"
+
+/*
+ * Change data capture: btree_insert/btree_delete append one record per
+ * row change to a log file that consumers tail by byte offset.
+ *
+ * Record (little-endian host layout):
+ *   u32 len      total record size, this field included
+ *   u8  op       CDC_OP_INSERT or CDC_OP_DELETE
+ *   u8  ulen     username bytes (0 for deletes)
+ *   u16 elen     email bytes (0 for deletes)
+ *   i32 id
+ *   username, email
+ *
+ * Records are batched in memory and written together, at most every
+ * CDC_FLUSH_INTERVAL_MS or when CDC_BUFFER_SIZE fills up. A full buffer
+ * is flushed synchronously, which is the writer's backpressure. Only
+ * whole records reach the file, but a reader may still see a torn tail
+ * after a crash; it stops at the first incomplete record.
+ */
+
+#define CDC_OP_INSERT 'I'
+#define CDC_OP_DELETE 'D'
+
+#define CDC_RECORD_HEADER_SIZE 12
+#define CDC_BUFFER_SIZE        (64u * 1024)
+#define CDC_FLUSH_INTERVAL_MS  10
+
+typedef struct ChangeFeed ChangeFeed;
+
+typedef struct {
+    uint8_t op;
+    Row row;      // only row.id is set for deletes
+} CdcRecord;
+
+ChangeFeed *cdc_open(const char *filename);
+void        cdc_append(ChangeFeed *feed, uint8_t op, const Row *row);
+void        cdc_tick(ChangeFeed *feed);     // statement boundary: flush if due
+void        cdc_close(ChangeFeed *feed);
+
+/* Consumer side: calls fn for every complete record at or after offset.
+ * Returns the offset to resume from. */
+typedef void (*CdcCallback)(const CdcRecord *rec, uint64_t offset, void *ctx);
+uint64_t cdc_read(const char *filename, uint64_t offset, CdcCallback fn, void *ctx);
+
+#endif
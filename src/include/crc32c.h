@@ -0,0 +1,10 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it. */
+uint32_t crc32c(const void *data, size_t len);
+
+#endif
@@ -3,7 +3,34 @@
 
 #include "btree.h"
 
+/* Reads page 0 only; PAGER_MEMORY_NAME opens an in-memory database */
 Table *db_open(const char *filename);
 void   db_close(Table *t);
 
+/* Read-only table over a shared mapping of the file (NULL if missing or empty).
+ * The header is not read until shm_attach, under the table latch. */
+Table *db_open_mapped(const char *filename);
+
+/* Read-only table that never writes the file back; see pager_open_readonly */
+Table *db_open_readonly(const char *filename, bool use_map);
+
+/* Header <-> page 0. Pages shipped from elsewhere need a reload. */
+void   db_sync_header(Table *t);
+void   db_reload_header(Table *t);
+
+/*
+ * Hot backup: step between statements to keep latency bounded.
+ * Every backup starts a new generation. A full backup writes a database
+ * image; an incremental one writes a page log holding only the pages
+ * changed since the previous backup of either kind.
+ */
+PagerBackup *db_backup_begin(Table *t, const char *dest_filename, bool incremental,
+                             char *errbuf, uint32_t errbuf_sz);
+bool         db_backup_step(Table *t, PagerBackup *b, uint32_t max_pages);
+bool         db_backup_finish(Table *t, PagerBackup *b, char *errbuf, uint32_t errbuf_sz);
+
+/* Applies an incremental backup onto a base copy; logs must go in generation order */
+bool db_restore_incremental(const char *base_filename, const char *log_filename,
+                            char *errbuf, uint32_t errbuf_sz);
+
 #endif
@@ -1,6 +1,7 @@
 #ifndef PAGER_H
 #define PAGER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -8,15 +9,232 @@
 #define PAGE_SIZE 4096
 #endif
 
+/*
+ * Page trailer: the last 4 bytes of every page hold a CRC-32C of the rest,
+ * written by pager_flush and checked when the page is read back.
+ * A stored value of 0 means "no checksum" (pages from older files); once
+ * the owner sets checksums_required, only never-written (all-zero) pages
+ * may have one.
+ */
+#define PAGE_TRAILER_SIZE 4
+#define PAGE_USABLE_SIZE  (PAGE_SIZE - PAGE_TRAILER_SIZE)
+
+/* Largest file database; page 0's change map has one bit for each page */
+#define PAGER_FILE_MAX_PAGES 256
+
+/* Database name that opens an anonymous in-memory pager */
+#define PAGER_MEMORY_NAME ":memory:"
+
+/* One bit per page; the owner of page 0 persists it between runs */
+#define PAGER_CHANGE_MAP_SIZE (PAGER_FILE_MAX_PAGES / 8)
+
+#define PAGER_PAGE_CHANGED(map, n) (((map)[(n) / 8] >> ((n) % 8)) & 1)
+
+/*
+ * Page log (incremental backups): PAGER_LOG_MAGIC followed by records of
+ * [u32 page_num][PAGE_SIZE bytes]. Later records supersede earlier ones.
+ */
+#define PAGER_LOG_MAGIC      "TDBPLOG1"
+#define PAGER_LOG_MAGIC_SIZE 8
+
+/* Resident pages pager_trim keeps by default: the whole file */
+#define PAGER_DEFAULT_CACHE_PAGES 256
+
+/* File space is preallocated this many pages at a time as the file grows */
+#define PAGER_GROW_PAGES 64
+
+/* Frames a sequential scan recycles once the cache is full */
+#define PAGER_SCAN_RING_PAGES 8
+
+/* 2Q queues of resident, unpinned pages */
+enum {
+    PAGER_QUEUE_PROBATION,   // read in, not yet used again by a later statement
+    PAGER_QUEUE_PROTECTED,   // re-used: the hot working set
+    PAGER_QUEUE_SCAN,        // read in by a sequential scan
+};
+
+/*
+ * Per-page state lives in arrays of `capacity` entries (bitmaps of
+ * capacity / 8 bytes), grown on first touch of a page past the end, up
+ * to max_pages. capacity never drops below PAGER_FILE_MAX_PAGES.
+ */
 typedef struct {
-    FILE *file;
+    FILE *file;         // NULL for an in-memory database
     uint32_t num_pages;
-    void *pages[256];   // TABLE_MAX_PAGES fixed here for simplicity in commit-10
+    uint32_t capacity;
+    uint32_t max_pages;
+    void **pages;
+    uint64_t change_seq;      // bumped on every pager_mark_dirty
+    uint64_t *page_seq;       // change_seq of each page's last modification
+    uint8_t *changed_map;     // pages modified since the last backup
+    uint8_t *map;       // read-only mapping of the file; NULL for a private cache
+    size_t map_size;
+    bool map_private;   // MAP_PRIVATE rather than MAP_SHARED
+    bool read_only;     // opened O_RDONLY: nothing may be dirtied or written back
+    bool checksums_required;  // every written page carries a trailer checksum
+    uint32_t *hits;           // pager_get_page calls per page, decayed on every warm save
+    uint32_t *warm_pages;     // pages still to prefetch, ascending
+    uint32_t warm_count;
+    uint32_t warm_next;
+    uint32_t cache_pages;     // pager_trim's target for resident pages
+    uint64_t use_clock;       // bumped on every pager_get_page
+    uint64_t *last_use;       // use_clock of each page's latest access
+    uint64_t *flushed_seq;    // page_seq as of the page's last write to disk
+    bool (*keep_resident)(const void *page);  // pages pager_trim must never evict
+    uint32_t resident;
+    uint8_t *cache_queue;         // PAGER_QUEUE_* of each resident page
+    uint64_t *loaded_at;          // use_clock when the page was read in
+    uint64_t epoch;               // bumped by pager_trim, i.e. once per statement
+    uint64_t *loaded_epoch;
+    uint8_t *ghost_map;           // evicted from probation, not seen since
+    uint32_t scan_ring[PAGER_SCAN_RING_PAGES];
+    uint32_t scan_ring_next;
+    uint16_t *pin_count;          // pinned pages are never evicted
+    uint8_t *released_map;        // freed pages whose disk space is still to be punched out
+    uint32_t file_reserved;       // pages of disk space preallocated for the file
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t evictions;
 } Pager;
 
+/*
+ * PAGER_MEMORY_NAME opens an anonymous pager: no file descriptor, every
+ * page stays resident (pager_trim never evicts), flushes do nothing and
+ * the database is gone on close. Its page table grows without the file
+ * format's PAGER_FILE_MAX_PAGES limit.
+ *
+ * A file is opened for writing under an exclusive flock, held until
+ * close, so a second writer or a read-only opener (pager_open_readonly)
+ * cannot open it at the same time. pager_open exits if the file is in
+ * use; pager_try_open returns NULL instead.
+ */
 Pager *pager_open(const char *filename);
+Pager *pager_try_open(const char *filename);
 void  *pager_get_page(Pager *pager, uint32_t page_num);
+void   pager_mark_dirty(Pager *pager, uint32_t page_num);
+void   pager_put_page(Pager *pager, uint32_t page_num, const void *data);  // overwrite without reading
 void   pager_flush(Pager *pager, uint32_t page_num);
 void   pager_close(Pager *pager);
 
+/*
+ * Cache budget. Callers hold raw page pointers for the length of an
+ * operation, so pages are only evicted by pager_trim, run at safe points
+ * between statements. Page 0 and pages keep_resident() accepts are a
+ * separate tier that is never evicted. The rest are managed 2Q-style:
+ *
+ *   - a page read in starts on probation, and moves to the protected
+ *     queue when a later statement uses it again, or straight away if
+ *     it was evicted from probation recently (the ghost map)
+ *   - trim evicts scan pages first, then probation pages oldest first
+ *     while probation holds over a quarter of the budget, then
+ *     protected pages least recently used first
+ *
+ * Dirty victims are written back first. Returns the number evicted.
+ */
+uint32_t pager_trim(Pager *pager);
+
+/*
+ * Sequential scan read (leaf chain walks). Pages it reads in bypass the
+ * main queues; once the cache is full, they are recycled through a ring
+ * of PAGER_SCAN_RING_PAGES frames, so a table scan cannot flush the hot
+ * set. Resident pages are returned without counting as a use.
+ */
+void    *pager_get_page_scan(Pager *pager, uint32_t page_num);
+
+/* Pins keep a resident page's frame in place across eviction points */
+void     pager_pin(Pager *pager, uint32_t page_num);
+void     pager_unpin(Pager *pager, uint32_t page_num);
+
+/* Asks the kernel to start reading a page that is not resident yet */
+void     pager_prefetch(Pager *pager, uint32_t page_num);
+
+/*
+ * Resident frame of a page, or NULL if it would have to be read in.
+ * No statistics or queue updates: for descents through pinned pages,
+ * whose frames stay put, so the page number works as a direct pointer.
+ */
+static inline void *pager_frame(const Pager *pager, uint32_t page_num) {
+    if (pager->map) {
+        return page_num < pager->num_pages ? pager->map + (size_t)page_num * PAGE_SIZE : NULL;
+    }
+    return page_num < pager->capacity ? pager->pages[page_num] : NULL;
+}
+
+/*
+ * Shared reader mode: pages are served straight from a MAP_SHARED
+ * read-only mapping, so every reader process on the host uses the one
+ * copy in the OS page cache. Nothing can be dirtied. pager_remap picks
+ * up pages another process appended. open returns NULL for a missing or
+ * empty file.
+ */
+Pager   *pager_open_mapped(const char *filename);
+void     pager_remap(Pager *pager);
+
+/*
+ * Read-only open: O_RDONLY plus a shared flock, so any number of reader
+ * processes can open the file while writers (pager_open), including an
+ * incremental restore, are kept out. Pages are served from a private
+ * cache, or with use_map from a MAP_PRIVATE mapping. Dirtying a page is
+ * fatal and close writes nothing. NULL if the file is missing, empty or
+ * locked exclusively.
+ */
+Pager   *pager_open_readonly(const char *filename, bool use_map);
+
+/*
+ * Warm cache file: PAGER_WARM_MAGIC, u32 count, then count page numbers,
+ * hottest first. Saving records the resident pages; loading queues the
+ * listed pages and asks the kernel to start reading them, and each step
+ * then pulls the next runs of adjacent pages into the cache with one
+ * read per run. Pages already resident are never overwritten.
+ */
+#define PAGER_WARM_MAGIC      "TDBWARM1"
+#define PAGER_WARM_MAGIC_SIZE 8
+
+bool     pager_warm_save(Pager *pager, const char *filename);
+uint32_t pager_warm_load(Pager *pager, const char *filename);  // pages queued
+bool     pager_warm_step(Pager *pager, uint32_t max_pages);    // true when done
+
+/*
+ * The owner of a page no longer uses it. The frame is dropped without
+ * being written, and the next full flush (pager_flush_since, close)
+ * punches the page's disk space out of the file, a run of adjacent
+ * pages at a time. Getting the page again before that gives zeros and
+ * takes it back into use, so it is no longer punched: code that walks
+ * every page (replication, warm-up) checks pager_released first.
+ */
+void     pager_release(Pager *pager, uint32_t page_num);
+bool     pager_released(const Pager *pager, uint32_t page_num);
+
+/* Writes every page modified after change_seq seq; returns the page count */
+uint32_t pager_flush_since(Pager *pager, uint64_t seq);
+
+/*
+ * Online backup. Pages are copied in file order in large runs; pages
+ * modified after the copy started are copied again in follow-up passes
+ * until a pass finds nothing new, so the result matches the database
+ * as of the last step. Writers may keep running between steps.
+ *
+ * With only_pages == NULL the destination is a full database image.
+ * Otherwise the first pass copies just the pages set in that bitmap and
+ * the destination is a page log.
+ */
+typedef struct PagerBackup PagerBackup;
+
+PagerBackup *pager_backup_begin(Pager *pager, const char *dest_filename, const uint8_t *only_pages);
+bool         pager_backup_step(PagerBackup *b, uint32_t max_pages);  // true when done
+bool         pager_backup_close(PagerBackup *b);  // false if the copy may not be on disk
+
+/* Page log reader: open checks the magic (NULL if missing); next returns
+ * 1 for a page, 0 at end of log, -1 for a truncated or corrupt record. */
+FILE *pager_log_open(const char *filename);
+int   pager_log_next(FILE *log, uint32_t *page_num, void *page);
+
+/* Trailer check of one page image; see PAGE_TRAILER_SIZE */
+bool pager_checksum_ok(const void *page, bool required);
+void pager_checksum_stamp(void *page);  // for page images sent elsewhere
+
+/* Checks every page on disk against its trailer checksum.
+ * Returns the number of corrupt pages; the first max_bad are stored in bad. */
+uint32_t pager_verify(Pager *pager, uint32_t *bad, uint32_t max_bad);
+
 #endif
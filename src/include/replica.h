@@ -0,0 +1,63 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "btree.h"
+
+/*
+ * Page-level replication to a local follower over a Unix socket.
+ *
+ * The primary ships every page changed since its last shipment (pager
+ * change sequence numbers) at statement boundaries. A new follower first
+ * receives a full snapshot. Shipments are framed; the last frame of a
+ * shipment carries REPLICA_FRAME_COMMIT, and the follower applies the
+ * pages only then, so its readers never see half a shipment. Every
+ * shipped page carries a fresh trailer checksum; a page that fails it,
+ * or lies past the follower's page limit, drops the connection.
+ *
+ * One shipment is in flight at a time: before shipping, the primary waits
+ * up to REPLICA_ACK_WAIT_MS for the previous one to be acknowledged. If
+ * the follower is slower than that, changes pile up on the primary and go
+ * out together in a later shipment.
+ *
+ * The follower acknowledges each commit with the sequence number and its
+ * measured lag (commit-to-apply time).
+ */
+
+#define REPLICA_MAGIC        0x52424454u   // "TDBR"
+#define REPLICA_FRAME_COMMIT 1u
+#define REPLICA_FRAME_PAGES  64            // pages per frame
+#define REPLICA_ACK_WAIT_MS  50
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t num_pages;    // followed by num_pages x [u32 page_num][page]
+    uint32_t reserved;
+    uint64_t seq;          // primary change_seq covered by this shipment
+    uint64_t sent_us;      // primary wall clock at shipment
+} ReplicaFrame;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t lag_us;
+} ReplicaAck;
+
+typedef struct Replicator Replicator;  // primary side
+typedef struct Follower Follower;      // replica side
+
+/* Primary */
+Replicator *replica_listen(Table *t, const char *socket_path, char *errbuf, uint32_t errbuf_sz);
+void        replica_ship(Replicator *r);      // call after every statement
+void        replica_print_status(Replicator *r);
+void        replica_close(Replicator *r);
+
+/* Follower: the table is read-only and kept in sync while waiting for input */
+Follower *replica_follow(Table *t, const char *socket_path, char *errbuf, uint32_t errbuf_sz);
+void      replica_wait_input(Follower *f, FILE *input);
+void      replica_print_follower_status(Follower *f);
+void      replica_unfollow(Follower *f);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "btree.h"
+
+/*
+ * Shared-memory coordination for one writer and many reader processes
+ * on the same host.
+ *
+ * Readers open the database with db_open_mapped, so all of them serve
+ * pages from one copy in the OS page cache. The coordination state lives
+ * in "<db>-shm", which every process maps MAP_SHARED:
+ *
+ *   - a generation counter, bumped each time the writer publishes
+ *   - SHM_MAX_READERS reader slots {pid, generation being read}
+ *
+ * Latches are fcntl record locks on that file. The kernel drops them
+ * when a process dies, so a crashed reader can never wedge the writer.
+ *   byte 0  table latch: readers hold it shared for a statement, and the
+ *           writer holds it exclusive while publishing
+ *   byte 1  writer latch: held exclusive by the single writer while attached
+ *
+ * The writer publishes at statement boundaries. It writes every page
+ * changed since the last publish under the exclusive table latch, so a
+ * reader sees either all of a statement's pages or none of them.
+ */
+
+#define SHM_MAGIC       "TDBSHM01"
+#define SHM_MAGIC_SIZE  8
+#define SHM_MAX_READERS 64
+
+typedef struct {
+    int32_t pid;           // 0 = free
+    uint32_t reserved;
+    uint64_t generation;   // snapshot the reader last started a statement on
+} ShmReaderSlot;
+
+typedef struct {
+    char magic[SHM_MAGIC_SIZE];
+    uint64_t generation;
+    int32_t writer_pid;    // informational; the writer latch is authoritative
+    uint32_t num_pages;    // database size as of the last publish
+    ShmReaderSlot readers[SHM_MAX_READERS];
+} ShmHeader;
+
+typedef struct SharedDb SharedDb;
+
+/* Writer: t must come from db_open. Readers: t must come from db_open_mapped,
+ * and attaching loads its header. */
+SharedDb *shm_attach(Table *t, const char *db_filename, bool writer,
+                     char *errbuf, uint32_t errbuf_sz);
+void      shm_publish(SharedDb *s);       // writer, at every statement boundary
+void      shm_read_begin(SharedDb *s);    // reader, around every statement
+void      shm_read_end(SharedDb *s);
+void      shm_print_status(SharedDb *s);
+void      shm_detach(SharedDb *s);
+
+#endif
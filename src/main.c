@@ -2,25 +2,48 @@
 // Commit 11: Delete ground work + tree introspection 
 // Commit 12: Delete with Rebalancing (borrow + merge for leaves)
 // Commit 13: Complete Internal Node Rebalancing (recursive)
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "db.h"
 #include "btree.h"
+#include "bulk.h"
+#include "replica.h"
+#include "cdc.h"
+#include "shm.h"
 
 #define INPUT_BUFFER_SIZE 1024
 
+/* Pages the background format converter examines after each statement */
+#define UPGRADE_PAGES_PER_STATEMENT 4
+
+/* Warm cache: pages prefetched after each statement, and how often the hot list is saved */
+#define WARM_PAGES_PER_STATEMENT 64
+#define WARM_SAVE_INTERVAL_S     60
+
 typedef enum {
     STMT_INSERT,
     STMT_SELECT,
-    STMT_DELETE
+    STMT_DELETE,
+    STMT_INCREMENT,
+    STMT_CAS
 } StatementType;
 
+/* Most ids a "select where id in (...)" line can hold */
+#define SELECT_MAX_KEYS (INPUT_BUFFER_SIZE / 2)
+
 typedef struct {
     StatementType type;
     Row row;
+    Row expected;                   // cas: the values that must still be there
+    long long delta;                // increment
+    int32_t keys[SELECT_MAX_KEYS];  // select ... where id in (keys)
+    size_t num_keys;                // 0 = select everything
 } Statement;
 
 static bool starts_with_icase_n(const char *s, const char *p, size_t n) {
@@ -36,6 +59,12 @@ static bool starts_with_icase_n(const char *s, const char *p, size_t n) {
     return true;
 }
 
+/* Keyword match that stops at a word boundary: "cas" but not "castle" */
+static bool starts_with_word(const char *s, const char *word) {
+    size_t n = strlen(word);
+    return starts_with_icase_n(s, word, n) && (s[n] == ' ' || s[n] == '\0');
+}
+
 static bool prepare_insert(const char *input, Statement *st) {
     st->type = STMT_INSERT;
     return sscanf(input, "insert %d %32s %255s",
@@ -47,10 +76,66 @@ static bool prepare_delete(const char *input, Statement *st) {
     return sscanf(input, "delete %d", &st->row.id) == 1;
 }
 
+/* select | select where id in (<id>, <id>, ...); anything else after select scans, as it always has */
+static bool prepare_select(const char *input, Statement *st) {
+    st->type = STMT_SELECT;
+    st->num_keys = 0;
+
+    const char *p = input + 6;
+    while (*p == ' ') p++;
+    if (!starts_with_icase_n(p, "where", 5)) return true;
+
+    if (!starts_with_icase_n(p, "where id in", 11)) {
+        puts("Syntax error. Could not parse statement.");
+        return false;
+    }
+    p += 11;
+    while (*p == ' ') p++;
+    if (*p++ != '(') {
+        puts("Syntax error. Could not parse statement.");
+        return false;
+    }
+
+    while (true) {
+        char *end;
+        errno = 0;
+        long id = strtol(p, &end, 10);
+        if (end == p || errno == ERANGE || id < INT32_MIN || id > INT32_MAX ||
+            st->num_keys == SELECT_MAX_KEYS) break;
+        st->keys[st->num_keys++] = (int32_t)id;
+
+        p = end;
+        while (*p == ' ') p++;
+        if (*p == ',') { p++; continue; }
+        if (*p == ')') return true;
+        break;
+    }
+
+    puts("Syntax error. Could not parse statement.");
+    return false;
+}
+
+/* increment <id> [delta] */
+static bool prepare_increment(const char *input, Statement *st) {
+    st->type = STMT_INCREMENT;
+    st->delta = 1;
+    return sscanf(input, "increment %d %lld", &st->row.id, &st->delta) >= 1;
+}
+
+/* cas <id> <expected username> <expected email> <new username> <new email> */
+static bool prepare_cas(const char *input, Statement *st) {
+    st->type = STMT_CAS;
+    return sscanf(input, "cas %d %32s %255s %32s %255s", &st->row.id,
+                  st->expected.username, st->expected.email,
+                  st->row.username, st->row.email) == 5;
+}
+
 static bool prepare_statement(const char *input, Statement *st) {
     if (starts_with_icase_n(input, "insert", 6)) return prepare_insert(input, st);
-    if (starts_with_icase_n(input, "select", 6)) { st->type = STMT_SELECT; return true; }
+    if (starts_with_icase_n(input, "select", 6)) return prepare_select(input, st);
     if (starts_with_icase_n(input, "delete", 6)) return prepare_delete(input, st);
+    if (starts_with_word(input, "increment")) return prepare_increment(input, st);
+    if (starts_with_word(input, "cas")) return prepare_cas(input, st);
     puts("Unrecognized statement");
     return false;
 }
@@ -65,17 +150,134 @@ static void execute_delete(Table *t, int32_t key) {
 }
 
 
+/* Rows handed out per btree_cursor_next_batch call by full scans */
+#define SCAN_BATCH_ROWS 64
+
 static void execute_select(Table *t) {
+    RowView rows[SCAN_BATCH_ROWS];
     Cursor *c = btree_table_start(t);
-    while (!c->end_of_table) {
-        Row row;
-        memcpy(&row, btree_cursor_value(c), sizeof(Row));
-        printf("(%d, %s, %s)\n", row.id, row.username, row.email);
-        btree_cursor_advance(c);
+
+    size_t n;
+    while ((n = btree_cursor_next_batch(c, rows, SCAN_BATCH_ROWS)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            printf("(%d, %s, %s)\n", rows[i].id, rows[i].username, rows[i].email);
+        }
     }
     btree_cursor_free(c);
 }
 
+static void print_found_row(int32_t key, const Row *row, void *ctx) {
+    (void)key;
+    (void)ctx;
+    if (row) printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+}
+
+static void execute_select_in(Table *t, const int32_t *keys, size_t n) {
+    btree_find_many(t, keys, n, print_found_row, NULL);
+}
+
+static void execute_upgrade(Table *t) {
+    uint32_t converted = 0;
+    while (!btree_upgrade_step(t, 64, &converted)) {}
+    printf("Upgraded %u pages.\n", converted);
+}
+
+static void execute_verify(Table *t) {
+    uint32_t bad[16];
+    uint32_t nbad = pager_verify(t->pager, bad, 16);
+    for (uint32_t i = 0; i < nbad && i < 16; i++) {
+        printf("Checksum mismatch on page %u\n", bad[i]);
+    }
+    if (nbad > 16) printf("... and %u more\n", nbad - 16);
+    printf("%u corrupt pages.\n", nbad);
+}
+
+static void execute_check(Table *t) {
+    BTreeCheckStats stats;
+    char err[128] = {0};
+    if (!btree_check(t, &stats, err, sizeof(err))) {
+        printf("Error: %s\n", err);
+        return;
+    }
+    printf("OK: depth %u, %u internal pages, %u leaves, %u rows.\n",
+           stats.depth, stats.internal_pages, stats.leaf_pages, stats.rows);
+}
+
+static void execute_backup(Table *t, const char *args) {
+    bool incremental = false;
+    if (strncmp(args, "--incremental ", 14) == 0) {
+        incremental = true;
+        args += 14;
+    }
+
+    char err[128] = {0};
+    PagerBackup *b = db_backup_begin(t, args, incremental, err, sizeof(err));
+    if (!b) {
+        printf("Error: %s\n", err);
+        return;
+    }
+    if (!db_backup_finish(t, b, err, sizeof(err))) {
+        printf("Error: %s\n", err);
+        return;
+    }
+    printf("Backup complete (generation %u).\n", t->header.backup_gen);
+}
+
+/* .restore <base> <log> [<log> ...] applies incremental backups in order */
+static void execute_restore(char *args) {
+    char *base = strtok(args, " ");
+    char *log = base ? strtok(NULL, " ") : NULL;
+    if (!log) {
+        puts("Usage: .restore <base.db> <incremental> [...]");
+        return;
+    }
+
+    for (; log; log = strtok(NULL, " ")) {
+        char err[128] = {0};
+        if (!db_restore_incremental(base, log, err, sizeof(err))) {
+            printf("Error: %s: %s\n", log, err);
+            return;
+        }
+        printf("Applied %s.\n", log);
+    }
+}
+
+static void execute_import(Table *t, const char *filename) {
+    uint64_t imported = 0, rejected = 0;
+    char err[128] = {0};
+    if (!bulk_import_csv(t, filename, &imported, &rejected, err, sizeof(err))) {
+        printf("Error: %s (%llu rows imported before it).\n", err, (unsigned long long)imported);
+        return;
+    }
+    printf("Imported %llu rows (%llu rejected).\n",
+           (unsigned long long)imported, (unsigned long long)rejected);
+}
+
+/* .export <file> [csv|binary] */
+static void execute_export(Table *t, char *args) {
+    char *filename = strtok(args, " ");
+    char *format_name = filename ? strtok(NULL, " ") : NULL;
+    if (!filename) {
+        puts("Usage: .export <file> [csv|binary]");
+        return;
+    }
+
+    ExportFormat format = EXPORT_CSV;
+    if (format_name && strcmp(format_name, "binary") == 0) format = EXPORT_BINARY;
+    else if (format_name && strcmp(format_name, "csv") != 0) {
+        printf("Error: unknown export format %s\n", format_name);
+        return;
+    }
+
+    uint64_t exported = 0;
+    char err[128] = {0};
+    if (!bulk_export(t, filename, format, &exported, err, sizeof(err))) {
+        printf("Error: %s\n", err);
+        return;
+    }
+    printf("Exported %llu rows.\n", (unsigned long long)exported);
+}
+
 static void execute_insert(Table *t, const Row *row) {
     char err[128] = {0};
     if (!btree_insert(t, row, err, sizeof(err))) {
@@ -85,23 +287,325 @@ static void execute_insert(Table *t, const Row *row) {
     puts("Executed.");
 }
 
-int main(void) {
+static void execute_increment(Table *t, int32_t key, long long delta) {
+    char err[128] = {0};
+    int64_t value = 0;
+    if (!btree_increment(t, key, delta, &value, err, sizeof(err))) {
+        printf("Error: %s\n", err);
+        return;
+    }
+    printf("Value %lld.\n", (long long)value);
+}
+
+static void execute_cas(Table *t, const Statement *st) {
+    char err[128] = {0};
+    bool swapped = false;
+    if (!btree_compare_and_swap(t, st->row.id, &st->expected, &st->row, &swapped, err, sizeof(err))) {
+        printf("Error: %s\n", err);
+        return;
+    }
+    puts(swapped ? "Swapped." : "Not swapped.");
+}
+
+static Replicator *execute_replicate(Table *t, Replicator *r, const char *socket_path) {
+    if (r) {
+        puts("Error: already replicating");
+        return r;
+    }
+
+    char err[160] = {0};
+    r = replica_listen(t, socket_path, err, sizeof(err));
+    if (!r) printf("Error: %s\n", err);
+    else printf("Listening for a follower on %s.\n", socket_path);
+    return r;
+}
+
+static void print_cdc_record(const CdcRecord *rec, uint64_t offset, void *ctx) {
+    (void)ctx;
+    if (rec->op == CDC_OP_INSERT)
+        printf("%llu: insert (%d, %s, %s)\n", (unsigned long long)offset,
+               rec->row.id, rec->row.username, rec->row.email);
+    else
+        printf("%llu: delete %d\n", (unsigned long long)offset, rec->row.id);
+}
+
+/* .cdc <file> | .cdc off | .cdc read <file> [offset] */
+static void execute_cdc(Table *t, char *args) {
+    char *arg = strtok(args, " ");
+    if (!arg) {
+        puts("Usage: .cdc <file> | .cdc off | .cdc read <file> [offset]");
+        return;
+    }
+
+    if (strcmp(arg, "read") == 0) {
+        char *filename = strtok(NULL, " ");
+        char *offset_arg = filename ? strtok(NULL, " ") : NULL;
+        if (!filename) {
+            puts("Usage: .cdc read <file> [offset]");
+            return;
+        }
+        uint64_t offset = offset_arg ? strtoull(offset_arg, NULL, 10) : 0;
+        uint64_t next = cdc_read(filename, offset, print_cdc_record, NULL);
+        printf("Next offset %llu.\n", (unsigned long long)next);
+        return;
+    }
+
+    cdc_close(t->cdc);
+    t->cdc = NULL;
+    if (strcmp(arg, "off") == 0) {
+        puts("Change capture off.");
+        return;
+    }
+
+    t->cdc = cdc_open(arg);
+    if (!t->cdc) printf("Error: cannot open %s\n", arg);
+    else printf("Capturing changes to %s.\n", arg);
+}
+
+/* .cache [pages]: show the page cache, or set its budget */
+static void execute_cache(Table *t, const char *arg) {
+    Pager *p = t->pager;
+
+    if (*arg) {
+        long pages = strtol(arg, NULL, 10);
+        if (pages < 1 || pages > TABLE_MAX_PAGES) {
+            printf("Error: cache size must be 1..%d pages\n", TABLE_MAX_PAGES);
+            return;
+        }
+        p->cache_pages = (uint32_t)pages;
+        pager_trim(p);
+    }
+
+    uint32_t pinned = 0, queued[3] = {0};
+    for (uint32_t i = 0; i < p->num_pages; i++) {
+        if (!p->pages[i]) continue;
+        if (i == 0 || btree_page_is_internal(p->pages[i])) pinned++;
+        else queued[p->cache_queue[i]]++;
+    }
+    printf("Cache: %u of %u pages resident (%u pinned, %u protected, %u probation, %u scan).\n",
+           p->resident, p->cache_pages, pinned, queued[PAGER_QUEUE_PROTECTED],
+           queued[PAGER_QUEUE_PROBATION], queued[PAGER_QUEUE_SCAN]);
+    printf("%llu hits, %llu misses, %llu evictions.\n", (unsigned long long)p->cache_hits,
+           (unsigned long long)p->cache_misses, (unsigned long long)p->evictions);
+}
+
+/* .batch begin | commit | abort: queue inserts and deletes, apply them as one */
+static void execute_batch(Table *t, WriteBatch **batch, const char *arg) {
+    if (strcmp(arg, "begin") == 0) {
+        if (!*batch) *batch = btree_batch_new();
+        btree_batch_clear(*batch);
+        puts("Batch started.");
+    } else if (!*batch) {
+        puts("Error: no batch in progress");
+    } else if (strcmp(arg, "commit") == 0) {
+        char err[128] = {0};
+        size_t n = btree_batch_count(*batch);
+        if (btree_batch_apply(t, *batch, err, sizeof(err))) printf("Applied %zu operations.\n", n);
+        else printf("Error: %s\n", err);
+        btree_batch_free(*batch);
+        *batch = NULL;
+    } else if (strcmp(arg, "abort") == 0) {
+        btree_batch_free(*batch);
+        *batch = NULL;
+        puts("Batch discarded.");
+    } else {
+        puts("Usage: .batch begin|commit|abort");
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--follow <socket> | --shared | --reader | --readonly [--mmap]] [file | "
+            PAGER_MEMORY_NAME "]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *filename = "test.db";
+    const char *follow_path = NULL;
+    bool shared_writer = false;
+    bool shared_reader = false;
+    bool readonly = false;
+    bool readonly_mmap = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--follow") == 0 && i + 1 < argc) {
+            follow_path = argv[++i];
+        } else if (strcmp(argv[i], "--shared") == 0) {
+            shared_writer = true;
+        } else if (strcmp(argv[i], "--reader") == 0) {
+            shared_reader = true;
+        } else if (strcmp(argv[i], "--readonly") == 0) {
+            readonly = true;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            readonly_mmap = true;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    // an in-memory database has no file for other processes to share
+    bool in_memory = strcmp(filename, PAGER_MEMORY_NAME) == 0;
+    if ((follow_path != NULL) + shared_writer + shared_reader + readonly > 1 ||
+        (in_memory && (shared_writer || shared_reader || readonly)) || (readonly_mmap && !readonly)) {
+        usage(argv[0]);
+        return 1;
+    }
+
     // Delete old test.db before running this commit.
-    Table *t = db_open("test.db");
+    Table *t = shared_reader ? db_open_mapped(filename)
+             : readonly      ? db_open_readonly(filename, readonly_mmap)
+             : db_open(filename);
+    if (!t) {
+        fprintf(stderr, "Error: cannot read %s (missing, empty or in use)\n", filename);
+        return 1;
+    }
+
+    // Shared mode: one writer process, any number of mapped readers
+    SharedDb *shared = NULL;
+    if (shared_writer || shared_reader) {
+        char err[160] = {0};
+        shared = shm_attach(t, filename, shared_writer, err, sizeof(err));
+        if (!shared) {
+            fprintf(stderr, "Error: %s\n", err);
+            db_close(t);
+            return 1;
+        }
+    }
+
+    // A follower is a read-only copy of another process's database
+    Follower *follower = NULL;
+    if (follow_path) {
+        char err[160] = {0};
+        follower = replica_follow(t, follow_path, err, sizeof(err));
+        if (!follower) {
+            fprintf(stderr, "Error: %s\n", err);
+            db_close(t);
+            return 1;
+        }
+        // unbuffered, so polling stdin's descriptor sees every pending line
+        setvbuf(stdin, NULL, _IONBF, 0);
+    }
+
+    // Warm cache: prefetch last run's hot pages, keep the list fresh
+    char warm_path[512] = {0};
+    bool warming = false;
+    time_t warm_saved_at = time(NULL);
+    if (!follower && !shared_reader && !readonly && !in_memory &&
+        snprintf(warm_path, sizeof(warm_path), "%s-warm", filename) < (int)sizeof(warm_path)) {
+        warming = pager_warm_load(t->pager, warm_path) > 0;
+    } else {
+        warm_path[0] = '\0';
+    }
 
     char input[INPUT_BUFFER_SIZE];
+    bool background_upgrade = false;
+    Replicator *replicator = NULL;
+    WriteBatch *batch = NULL;   // open .batch, if any
 
     while (true) {
+        if (background_upgrade) {
+            background_upgrade = !btree_upgrade_step(t, UPGRADE_PAGES_PER_STATEMENT, NULL);
+        }
+        if (warming) warming = !pager_warm_step(t->pager, WARM_PAGES_PER_STATEMENT);
+        if (warm_path[0] && time(NULL) - warm_saved_at >= WARM_SAVE_INTERVAL_S) {
+            pager_warm_save(t->pager, warm_path);
+            warm_saved_at = time(NULL);
+        }
+        if (replicator) replica_ship(replicator);
+        if (t->cdc) cdc_tick(t->cdc);
+        if (shared_reader) shm_read_end(shared);
+        else if (shared) shm_publish(shared);
+        pager_trim(t->pager);  // after publishing: victims are already clean
+
         printf("minidb> ");
+        if (follower) {
+            fflush(stdout);
+            replica_wait_input(follower, stdin);
+        }
         if (!fgets(input, sizeof(input), stdin)) break;
         input[strcspn(input, "\n")] = 0;
 
+        bool read_only = (follower != NULL || shared_reader || readonly);
+        const char *read_only_error = readonly ? "Error: read-only database" : "Error: read-only replica";
+        if (shared_reader) shm_read_begin(shared);
+
         if (input[0] == '.') {
             if (strcmp(input, ".exit") == 0) break;
+            if (strncmp(input, ".replicate ", 11) == 0 && !read_only) {
+                replicator = execute_replicate(t, replicator, input + 11);
+                continue;
+            }
+            if (strncmp(input, ".cdc ", 5) == 0) {
+                execute_cdc(t, input + 5);
+                continue;
+            }
+            if (strcmp(input, ".shared") == 0) {
+                if (shared) shm_print_status(shared);
+                else puts("Shared mode is off.");
+                continue;
+            }
+            if (strcmp(input, ".replication") == 0) {
+                if (follower) replica_print_follower_status(follower);
+                else if (replicator) replica_print_status(replicator);
+                else puts("Replication is off.");
+                continue;
+            }
+            if (strcmp(input, ".cache") == 0 || strncmp(input, ".cache ", 7) == 0) {
+                execute_cache(t, input[6] ? input + 7 : "");
+                continue;
+            }
+            if (strncmp(input, ".batch ", 7) == 0 && !read_only) {
+                execute_batch(t, &batch, input + 7);
+                continue;
+            }
             if (strcmp(input, ".btree") == 0) {
                 btree_print(t);
                 continue;
             }
+            if (strcmp(input, ".check") == 0) {
+                execute_check(t);
+                continue;
+            }
+            // a backup starts a new generation in the header
+            if ((shared_reader || readonly) && strncmp(input, ".backup ", 8) == 0) {
+                puts(read_only_error);
+                continue;
+            }
+            if (strncmp(input, ".backup ", 8) == 0) {
+                execute_backup(t, input + 8);
+                continue;
+            }
+            if (strncmp(input, ".restore ", 9) == 0) {
+                execute_restore(input + 9);
+                continue;
+            }
+            if (read_only && (strncmp(input, ".import ", 8) == 0 || strncmp(input, ".upgrade", 8) == 0)) {
+                puts(read_only_error);
+                continue;
+            }
+            if (strncmp(input, ".import ", 8) == 0) {
+                execute_import(t, input + 8);
+                continue;
+            }
+            if (strncmp(input, ".export ", 8) == 0) {
+                execute_export(t, input + 8);
+                continue;
+            }
+            if (strcmp(input, ".verify") == 0) {
+                execute_verify(t);
+                continue;
+            }
+            if (strcmp(input, ".upgrade") == 0) {
+                execute_upgrade(t);
+                continue;
+            }
+            if (strcmp(input, ".upgrade auto") == 0) {
+                background_upgrade = true;
+                puts("Background upgrade enabled.");
+                continue;
+            }
 
             puts("Unrecognized meta command");
             continue;
@@ -111,11 +615,36 @@ int main(void) {
         Statement st;
         if (!prepare_statement(input, &st)) continue;
 
+        if (read_only && st.type != STMT_SELECT) {
+            puts(read_only_error);
+            continue;
+        }
+
+        if (batch && st.type == STMT_INSERT) {
+            btree_batch_insert(batch, &st.row);
+            puts("Queued.");
+            continue;
+        }
+        if (batch && st.type == STMT_DELETE) {
+            btree_batch_delete(batch, st.row.id);
+            puts("Queued.");
+            continue;
+        }
+
         if (st.type == STMT_INSERT) execute_insert(t, &st.row);
+        else if (st.type == STMT_SELECT && st.num_keys > 0) execute_select_in(t, st.keys, st.num_keys);
         else if (st.type == STMT_SELECT) execute_select(t); 
+        else if (st.type == STMT_INCREMENT) execute_increment(t, st.row.id, st.delta);
+        else if (st.type == STMT_CAS) execute_cas(t, &st);
         else execute_delete(t, st.row.id);
     }
 
+    btree_batch_free(batch);
+    replica_close(replicator);
+    replica_unfollow(follower);
+    shm_detach(shared);
+    if (warm_path[0]) pager_warm_save(t->pager, warm_path);
+    cdc_close(t->cdc);
     db_close(t);
     return 0;
 }
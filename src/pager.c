@@ -1,78 +1,870 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE  // flock, fallocate
+
 #include "pager.h"
+#include "crc32c.h"
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Pages read per fread() while verifying the whole file */
+#define VERIFY_CHUNK_PAGES 64
+
+/* Largest run a backup step copies with a single read/write */
+#define BACKUP_CHUNK_PAGES 64
+
+/* Largest run a warm-up step reads with a single fread() */
+#define WARM_CHUNK_PAGES 64
+
+/* Page table limit of an in-memory pager; keeps capacity a power of two */
+#define MEMORY_MAX_PAGES (1u << 31)
+
+struct PagerBackup {
+    Pager *src;
+    FILE *dest;
+    uint32_t next_page;   // copy position within the current pass
+    bool full_pass;       // first pass copies every page
+    uint64_t since_seq;   // later passes copy pages changed after this
+    uint64_t pass_seq;    // change_seq when the current pass started
+    bool page_log;        // append [page_num][page] records instead of an image
+    uint8_t only_pages[PAGER_CHANGE_MAP_SIZE];
+    uint8_t *buf;
+};
 
 static void die(const char *msg) {
     perror(msg);
     exit(1);
 }
 
+static uint32_t *page_trailer(void *page) {
+    return (uint32_t *)((uint8_t *)page + PAGE_USABLE_SIZE);
+}
+
+/* 0 is reserved for "no checksum", so a CRC of 0 is stored as 1 */
+static uint32_t page_crc(const void *page) {
+    uint32_t crc = crc32c(page, PAGE_USABLE_SIZE);
+    return crc ? crc : 1;
+}
+
+static bool page_is_zero(const uint8_t *page) {
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        if (page[i]) return false;
+    }
+    return true;
+}
+
+bool pager_checksum_ok(const void *page, bool required) {
+    uint32_t stored;
+    memcpy(&stored, (const uint8_t *)page + PAGE_USABLE_SIZE, sizeof(stored));
+    if (stored == 0) {
+        // never-written space reads as zeros; anything else lost its trailer
+        return !required || page_is_zero(page);
+    }
+    return stored == page_crc(page);
+}
+
+void pager_checksum_stamp(void *page) {
+    *page_trailer(page) = page_crc(page);
+}
+
+static bool page_checksum_ok(const Pager *pager, const void *page) {
+    return pager_checksum_ok(page, pager->checksums_required);
+}
+
 static long page_offset(uint32_t page_num) {
     // safe promotion before multiply
     return (long)page_num * (long)PAGE_SIZE;
 }
 
-Pager *pager_open(const char *filename) {
+/* realloc that zeroes the new tail */
+static void *grow_array(void *array, size_t old_count, size_t new_count, size_t elem_size) {
+    uint8_t *grown = realloc(array, new_count * elem_size);
+    if (!grown) die("realloc");
+    memset(grown + old_count * elem_size, 0, (new_count - old_count) * elem_size);
+    return grown;
+}
+
+#define GROW(field, old, cap) \
+    (field) = grow_array((field), (old), (cap), sizeof(*(field)))
+
+/* Makes page_num addressable in every per-page array, doubling as needed */
+static void pager_reserve(Pager *pager, uint32_t page_num) {
+    if (page_num < pager->capacity) return;
+    if (page_num >= pager->max_pages) die("page out of bounds");
+
+    uint32_t old = pager->capacity;
+    uint32_t cap = old ? old : PAGER_FILE_MAX_PAGES;
+    while (cap <= page_num) cap *= 2;
+
+    GROW(pager->pages, old, cap);
+    GROW(pager->page_seq, old, cap);
+    GROW(pager->hits, old, cap);
+    GROW(pager->last_use, old, cap);
+    GROW(pager->flushed_seq, old, cap);
+    GROW(pager->cache_queue, old, cap);
+    GROW(pager->loaded_at, old, cap);
+    GROW(pager->loaded_epoch, old, cap);
+    GROW(pager->pin_count, old, cap);
+    GROW(pager->changed_map, old / 8, cap / 8);
+    GROW(pager->ghost_map, old / 8, cap / 8);
+    GROW(pager->released_map, old / 8, cap / 8);
+    pager->capacity = cap;
+}
+
+static Pager *pager_alloc(FILE *file, uint32_t max_pages) {
+    Pager *p = calloc(1, sizeof(Pager));
+    if (!p) die("calloc");
+
+    p->file = file;
+    p->max_pages = max_pages;
+    p->cache_pages = PAGER_DEFAULT_CACHE_PAGES;
+    pager_reserve(p, PAGER_FILE_MAX_PAGES - 1);
+    return p;
+}
+
+static void pager_free(Pager *pager) {
+    free(pager->pages);
+    free(pager->page_seq);
+    free(pager->hits);
+    free(pager->last_use);
+    free(pager->flushed_seq);
+    free(pager->cache_queue);
+    free(pager->loaded_at);
+    free(pager->loaded_epoch);
+    free(pager->pin_count);
+    free(pager->changed_map);
+    free(pager->ghost_map);
+    free(pager->released_map);
+    free(pager->warm_pages);
+    free(pager);
+}
+
+Pager *pager_try_open(const char *filename) {
+    if (strcmp(filename, PAGER_MEMORY_NAME) == 0) return pager_alloc(NULL, MEMORY_MAX_PAGES);
+
     FILE *f = fopen(filename, "r+b");
     if (!f) f = fopen(filename, "w+b");
     if (!f) die("fopen");
 
-    if (fseek(f, 0, SEEK_END) != 0) die("fseek");
-    long size = ftell(f);
-    if (size < 0) die("ftell");
+    // held until close: no other writer or read-only opener while we rewrite pages
+    if (flock(fileno(f), LOCK_EX | LOCK_NB) != 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) die("fstat");
+    off_t size = st.st_size;
 
     if (size % PAGE_SIZE != 0 && size != 0) {
         die("corrupt db (partial page)");
     }
 
-    Pager *p = calloc(1, sizeof(Pager));
-    if (!p) die("calloc");
+    if (size / PAGE_SIZE > PAGER_FILE_MAX_PAGES) die("corrupt db (too many pages)");
 
-    p->file = f;
+    Pager *p = pager_alloc(f, PAGER_FILE_MAX_PAGES);
     p->num_pages = (uint32_t)(size / PAGE_SIZE);
+    p->file_reserved = p->num_pages;
+    return p;
+}
 
+Pager *pager_open(const char *filename) {
+    Pager *p = pager_try_open(filename);
+    if (!p) {
+        fprintf(stderr, "%s is in use by another process\n", filename);
+        exit(1);
+    }
     return p;
 }
 
+static bool released_test(const Pager *pager, uint32_t page_num) {
+    return (pager->released_map[page_num / 8] >> (page_num % 8)) & 1;
+}
+
+static bool ghost_test(const Pager *pager, uint32_t page_num) {
+    return (pager->ghost_map[page_num / 8] >> (page_num % 8)) & 1;
+}
+
+static void ghost_set(Pager *pager, uint32_t page_num, bool on) {
+    uint8_t bit = (uint8_t)(1u << (page_num % 8));
+    if (on) pager->ghost_map[page_num / 8] |= bit;
+    else pager->ghost_map[page_num / 8] &= (uint8_t)~bit;
+}
+
+/* Puts a page into the cache on the given queue */
+static void page_install(Pager *pager, uint32_t page_num, void *page, uint8_t queue) {
+    pager->pages[page_num] = page;
+    pager->resident++;
+    pager->cache_queue[page_num] = queue;
+    pager->loaded_at[page_num] = pager->use_clock;
+    pager->loaded_epoch[page_num] = pager->epoch;
+    ghost_set(pager, page_num, false);
+    pager->released_map[page_num / 8] &= (uint8_t)~(1u << (page_num % 8));  // in use again
+
+    if (page_num >= pager->num_pages) {
+        pager->num_pages = page_num + 1;
+    }
+}
+
+static void *page_load(Pager *pager, uint32_t page_num, uint8_t queue) {
+    pager->cache_misses++;
+    void *page = calloc(1, PAGE_SIZE);
+    if (!page) die("calloc");
+
+    // a released page's old contents are garbage, maybe already a hole
+    if (pager->file && page_num < pager->num_pages && !released_test(pager, page_num)) {
+        if (fseek(pager->file, page_offset(page_num), SEEK_SET) != 0) die("fseek");
+        size_t nread = fread(page, PAGE_SIZE, 1, pager->file);
+        if (nread != 1 && !feof(pager->file)) die("fread");
+
+        if (!page_checksum_ok(pager, page)) {
+            fprintf(stderr, "corrupt db (checksum mismatch on page %u)\n", page_num);
+            exit(1);
+        }
+    }
+
+    page_install(pager, page_num, page, queue);
+    return page;
+}
+
 void *pager_get_page(Pager *pager, uint32_t page_num) {
-    if (page_num >= 256) die("page out of bounds");
+    if (pager->map) {
+        if (page_num >= pager->num_pages) die("page out of bounds");
+        return pager->map + (size_t)page_num * PAGE_SIZE;
+    }
+    pager_reserve(pager, page_num);
 
-    if (pager->pages[page_num] == NULL) {
-        void *page = calloc(1, PAGE_SIZE);
-        if (!page) die("calloc");
+    pager->hits[page_num]++;
+    pager->last_use[page_num] = ++pager->use_clock;
 
-        if (page_num < pager->num_pages) {
-            if (fseek(pager->file, page_offset(page_num), SEEK_SET) != 0) die("fseek");
-            size_t nread = fread(page, PAGE_SIZE, 1, pager->file);
-            if (nread != 1 && !feof(pager->file)) die("fread");
+    if (pager->pages[page_num]) {
+        pager->cache_hits++;
+        // Used again by a later statement: part of the working set
+        if (pager->loaded_epoch[page_num] != pager->epoch) {
+            pager->cache_queue[page_num] = PAGER_QUEUE_PROTECTED;
         }
+        return pager->pages[page_num];
+    }
+
+    return page_load(pager, page_num,
+                     ghost_test(pager, page_num) ? PAGER_QUEUE_PROTECTED : PAGER_QUEUE_PROBATION);
+}
+
+void pager_mark_dirty(Pager *pager, uint32_t page_num) {
+    if (pager->read_only) {
+        fprintf(stderr, "write to read-only db (page %u)\n", page_num);
+        exit(1);
+    }
+    pager_reserve(pager, page_num);
+    pager->page_seq[page_num] = ++pager->change_seq;
+    pager->changed_map[page_num / 8] |= (uint8_t)(1u << (page_num % 8));
+}
+
+void pager_put_page(Pager *pager, uint32_t page_num, const void *data) {
+    pager_reserve(pager, page_num);
+
+    if (pager->pages[page_num] == NULL) {
+        void *page = malloc(PAGE_SIZE);
+        if (!page) die("malloc");
+        page_install(pager, page_num, page, PAGER_QUEUE_PROBATION);
+    }
+
+    memcpy(pager->pages[page_num], data, PAGE_SIZE);
+    pager_mark_dirty(pager, page_num);
+}
+
+/*
+ * Growing the file a page at a time makes the filesystem allocate (and
+ * log) a block per write and scatters the file. Past the end of what is
+ * reserved, preallocate the next PAGER_GROW_PAGES in one go; KEEP_SIZE
+ * leaves the file length, and so num_pages on reopen, to the writes.
+ */
+static void reserve_file_space(Pager *pager, uint32_t page_num) {
+    if (page_num < pager->file_reserved) return;
+
+    uint32_t end = (page_num / PAGER_GROW_PAGES + 1) * PAGER_GROW_PAGES;
+    if (end > pager->max_pages) end = pager->max_pages;
+
+    if (fallocate(fileno(pager->file), FALLOC_FL_KEEP_SIZE, page_offset(pager->file_reserved),
+                  (off_t)(end - pager->file_reserved) * PAGE_SIZE) != 0) {
+        end = pager->max_pages;  // not supported here: grow page by page from now on
+    }
+    pager->file_reserved = end;
+}
 
-        pager->pages[page_num] = page;
+/*
+ * Gives the disk space of released pages back to the filesystem, one call
+ * per run. The pages just written, which no longer point at the released
+ * ones, are made durable first: otherwise a power loss could keep a hole
+ * while losing the parent rewrite that stopped using it.
+ */
+static void punch_released(Pager *pager) {
+    uint32_t first = 0;
+    while (first < pager->num_pages && !released_test(pager, first)) first++;
+    if (first == pager->num_pages) return;
 
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
+    if (pager->file && (fflush(pager->file) != 0 || fsync(fileno(pager->file)) != 0)) die("fsync");
+
+    for (uint32_t i = first; i < pager->num_pages;) {
+        if (!released_test(pager, i)) {
+            i++;
+            continue;
+        }
+        uint32_t j = i;
+        while (j < pager->num_pages && released_test(pager, j)) {
+            pager->released_map[j / 8] &= (uint8_t)~(1u << (j % 8));
+            j++;
         }
+        if (pager->file) {
+            // best effort: without hole punching the pages just wait to be reused
+            fallocate(fileno(pager->file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      page_offset(i), (off_t)(j - i) * PAGE_SIZE);
+        }
+        i = j;
     }
+}
 
-    return pager->pages[page_num];
+void pager_release(Pager *pager, uint32_t page_num) {
+    if (pager->read_only) {
+        fprintf(stderr, "write to read-only db (page %u)\n", page_num);
+        exit(1);
+    }
+    pager_reserve(pager, page_num);
+    if (pager->pin_count[page_num]) die("release of a pinned page");
+
+    if (pager->pages[page_num]) {
+        free(pager->pages[page_num]);
+        pager->pages[page_num] = NULL;
+        pager->resident--;
+    }
+    pager->flushed_seq[page_num] = pager->page_seq[page_num];  // nothing left to write
+    pager->released_map[page_num / 8] |= (uint8_t)(1u << (page_num % 8));
+}
+
+bool pager_released(const Pager *pager, uint32_t page_num) {
+    return page_num < pager->capacity && released_test(pager, page_num);
 }
 
 void pager_flush(Pager *pager, uint32_t page_num) {
-    if (!pager->pages[page_num]) return;
+    if (!pager->file || pager->read_only || !pager->pages[page_num]) return;
+
+    reserve_file_space(pager, page_num);
+    *page_trailer(pager->pages[page_num]) = page_crc(pager->pages[page_num]);
 
     if (fseek(pager->file, page_offset(page_num), SEEK_SET) != 0) die("fseek");
     if (fwrite(pager->pages[page_num], PAGE_SIZE, 1, pager->file) != 1) die("fwrite");
+    pager->flushed_seq[page_num] = pager->page_seq[page_num];
+}
+
+uint32_t pager_flush_since(Pager *pager, uint64_t seq) {
+    if (!pager->file) return 0;
+
+    uint32_t flushed = 0;
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        if (pager->pages[i] && pager->page_seq[i] > seq) {
+            pager_flush(pager, i);
+            flushed++;
+        }
+    }
+    punch_released(pager);
+    return flushed;
+}
+
+/* ============================================================
+ * Cache budget
+ * ============================================================ */
+
+static void pager_evict(Pager *pager, uint32_t page_num) {
+    if (pager->page_seq[page_num] > pager->flushed_seq[page_num]) pager_flush(pager, page_num);
+    free(pager->pages[page_num]);
+    pager->pages[page_num] = NULL;
+    pager->resident--;
+    pager->evictions++;
+}
+
+/* Next page to evict under 2Q, or 0 when only the pinned tier is left */
+static uint32_t trim_victim(Pager *pager) {
+    uint32_t oldest[3] = {0};
+    uint64_t oldest_at[3] = { UINT64_MAX, UINT64_MAX, UINT64_MAX };
+    uint32_t count[3] = {0};
+
+    for (uint32_t i = 1; i < pager->num_pages; i++) {
+        if (!pager->pages[i] || pager->pin_count[i]) continue;
+        if (pager->keep_resident && pager->keep_resident(pager->pages[i])) continue;
+
+        uint8_t q = pager->cache_queue[i];
+        uint64_t at = (q == PAGER_QUEUE_PROTECTED) ? pager->last_use[i] : pager->loaded_at[i];
+        count[q]++;
+        if (at < oldest_at[q]) {
+            oldest_at[q] = at;
+            oldest[q] = i;
+        }
+    }
+
+    if (count[PAGER_QUEUE_SCAN]) return oldest[PAGER_QUEUE_SCAN];
+    if (count[PAGER_QUEUE_PROBATION] &&
+        (count[PAGER_QUEUE_PROBATION] > pager->cache_pages / 4 || !count[PAGER_QUEUE_PROTECTED])) {
+        return oldest[PAGER_QUEUE_PROBATION];
+    }
+    return oldest[PAGER_QUEUE_PROTECTED];
+}
+
+uint32_t pager_trim(Pager *pager) {
+    if (pager->map || !pager->file) return 0;  // in memory, the cache is the database
+    pager->epoch++;
+
+    uint32_t evicted = 0;
+    while (pager->resident > pager->cache_pages) {
+        uint32_t victim = trim_victim(pager);
+        if (victim == 0) break;  // the pinned tier alone may exceed the budget
+
+        // Remember it: coming back soon means it belongs in the protected queue
+        if (pager->cache_queue[victim] == PAGER_QUEUE_PROBATION) ghost_set(pager, victim, true);
+        pager_evict(pager, victim);
+        evicted++;
+    }
+    return evicted;
+}
+
+void pager_pin(Pager *pager, uint32_t page_num) {
+    pager_reserve(pager, page_num);
+    pager->pin_count[page_num]++;
+}
+
+void pager_unpin(Pager *pager, uint32_t page_num) {
+    if (page_num >= pager->capacity || pager->pin_count[page_num] == 0) die("unbalanced unpin");
+    pager->pin_count[page_num]--;
+}
+
+void pager_prefetch(Pager *pager, uint32_t page_num) {
+    if (!pager->file || pager->map || page_num >= pager->num_pages || pager->pages[page_num]) return;
+    posix_fadvise(fileno(pager->file), page_offset(page_num), PAGE_SIZE, POSIX_FADV_WILLNEED);
+}
+
+void *pager_get_page_scan(Pager *pager, uint32_t page_num) {
+    if (pager->map) return pager_get_page(pager, page_num);
+    pager_reserve(pager, page_num);
+
+    if (pager->pages[page_num]) {
+        pager->cache_hits++;
+        return pager->pages[page_num];
+    }
+
+    // Cache full: reuse the frame of the oldest scan page still in the ring
+    uint32_t *slot = &pager->scan_ring[pager->scan_ring_next];
+    if (pager->file && pager->resident >= pager->cache_pages && *slot != 0 && pager->pages[*slot] &&
+        pager->cache_queue[*slot] == PAGER_QUEUE_SCAN && !pager->pin_count[*slot] &&
+        pager->page_seq[*slot] <= pager->flushed_seq[*slot]) {
+        pager_evict(pager, *slot);
+    }
+
+    void *page = page_load(pager, page_num, PAGER_QUEUE_SCAN);
+    *slot = page_num;
+    pager->scan_ring_next = (pager->scan_ring_next + 1) % PAGER_SCAN_RING_PAGES;
+    return page;
 }
 
 void pager_close(Pager *pager) {
     if (!pager) return;
-    for (uint32_t i = 0; i < 256; i++) {
+    if (pager->map && munmap(pager->map, pager->map_size) != 0) die("munmap");
+    for (uint32_t i = 0; i < pager->capacity; i++) {
         if (pager->pages[i]) {
-            pager_flush(pager, i);
+            // Clean pages already match the file
+            if (pager->page_seq[i] > pager->flushed_seq[i]) pager_flush(pager, i);
             free(pager->pages[i]);
             pager->pages[i] = NULL;
         }
     }
-    fclose(pager->file);
-    free(pager);
+    if (!pager->read_only) punch_released(pager);
+    if (pager->file) fclose(pager->file);
+    pager_free(pager);
+}
+
+/* ============================================================
+ * Shared reader mapping
+ * ============================================================ */
+
+Pager *pager_open_mapped(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return NULL;
+
+    Pager *p = pager_alloc(f, PAGER_FILE_MAX_PAGES);
+    p->read_only = true;
+    pager_remap(p);
+    if (p->num_pages == 0) {
+        fclose(f);
+        pager_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+Pager *pager_open_readonly(const char *filename, bool use_map) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return NULL;
+
+    struct stat st;
+    if (flock(fileno(f), LOCK_SH | LOCK_NB) != 0 || fstat(fileno(f), &st) != 0 ||
+        st.st_size < PAGE_SIZE || st.st_size % PAGE_SIZE != 0 ||
+        st.st_size / PAGE_SIZE > PAGER_FILE_MAX_PAGES) {
+        fclose(f);
+        return NULL;
+    }
+
+    Pager *p = pager_alloc(f, PAGER_FILE_MAX_PAGES);
+    p->read_only = true;
+    p->num_pages = (uint32_t)(st.st_size / PAGE_SIZE);
+    if (use_map) {
+        p->map_private = true;
+        pager_remap(p);
+    }
+    return p;
+}
+
+void pager_remap(Pager *pager) {
+    struct stat st;
+    if (fstat(fileno(pager->file), &st) != 0) die("fstat");
+
+    // Only whole pages; the writer may be halfway through extending the file
+    size_t size = (size_t)st.st_size / PAGE_SIZE * PAGE_SIZE;
+    if (size > (size_t)PAGER_FILE_MAX_PAGES * PAGE_SIZE) size = (size_t)PAGER_FILE_MAX_PAGES * PAGE_SIZE;
+    if (pager->map && size == pager->map_size) return;
+
+    if (pager->map && munmap(pager->map, pager->map_size) != 0) die("munmap");
+    pager->map = NULL;
+    pager->map_size = 0;
+    pager->num_pages = 0;
+    if (size == 0) return;
+
+    void *map = mmap(NULL, size, PROT_READ, pager->map_private ? MAP_PRIVATE : MAP_SHARED,
+                     fileno(pager->file), 0);
+    if (map == MAP_FAILED) die("mmap");
+
+    pager->map = map;
+    pager->map_size = size;
+    pager->num_pages = (uint32_t)(size / PAGE_SIZE);
+}
+
+/* ============================================================
+ * Warm cache
+ * ============================================================ */
+
+typedef struct {
+    uint32_t hits;
+    uint32_t page_num;
+} WarmEntry;
+
+static int hotter_first(const void *a, const void *b) {
+    const WarmEntry *x = a, *y = b;
+    if (x->hits != y->hits) return x->hits > y->hits ? -1 : 1;
+    return (x->page_num > y->page_num) - (x->page_num < y->page_num);
+}
+
+static int ascending(const void *a, const void *b) {
+    return (*(const uint32_t *)a > *(const uint32_t *)b) - (*(const uint32_t *)a < *(const uint32_t *)b);
+}
+
+bool pager_warm_save(Pager *pager, const char *filename) {
+    if (!pager->file) return false;
+
+    WarmEntry *entries = malloc((pager->num_pages ? pager->num_pages : 1) * sizeof(WarmEntry));
+    uint32_t *list = malloc((pager->num_pages ? pager->num_pages : 1) * sizeof(uint32_t));
+    if (!entries || !list) die("malloc");
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        if (pager->pages[i]) entries[count++] = (WarmEntry){ pager->hits[i], i };
+    }
+    qsort(entries, count, sizeof(entries[0]), hotter_first);
+    for (uint32_t i = 0; i < count; i++) list[i] = entries[i].page_num;
+    free(entries);
+
+    // Write a temporary and rename, so a crash never leaves half a list
+    char tmp[512];
+    FILE *f = NULL;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp) ||
+        !(f = fopen(tmp, "wb"))) {
+        free(list);
+        return false;
+    }
+    bool ok = fwrite(PAGER_WARM_MAGIC, PAGER_WARM_MAGIC_SIZE, 1, f) == 1 &&
+              fwrite(&count, sizeof(count), 1, f) == 1 &&
+              fwrite(list, sizeof(list[0]), count, f) == count;
+    free(list);
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(tmp, filename) != 0) {
+        remove(tmp);
+        return false;
+    }
+
+    // Halve the counters so the next save favours recent traffic
+    for (uint32_t i = 0; i < pager->capacity; i++) pager->hits[i] /= 2;
+    return true;
+}
+
+uint32_t pager_warm_load(Pager *pager, const char *filename) {
+    if (!pager->file) return 0;
+    FILE *f = fopen(filename, "rb");
+    if (!f) return 0;
+
+    char magic[PAGER_WARM_MAGIC_SIZE];
+    uint32_t count = 0;
+    uint32_t *list = NULL;
+    if (fread(magic, sizeof(magic), 1, f) != 1 ||
+        memcmp(magic, PAGER_WARM_MAGIC, PAGER_WARM_MAGIC_SIZE) != 0 ||
+        fread(&count, sizeof(count), 1, f) != 1 || count > pager->max_pages ||
+        !(list = malloc((count ? count : 1) * sizeof(uint32_t))) ||
+        fread(list, sizeof(list[0]), count, f) != count) {
+        free(list);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    // The file may have shrunk or been replaced since the list was saved;
+    // only pages already on disk can be read ahead
+    struct stat st;
+    if (fstat(fileno(pager->file), &st) != 0) die("fstat");
+    uint32_t disk_pages = (uint32_t)(st.st_size / PAGE_SIZE);
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (list[i] < pager->num_pages && list[i] < disk_pages) list[n++] = list[i];
+    }
+    qsort(list, n, sizeof(list[0]), ascending);
+
+    free(pager->warm_pages);
+    pager->warm_pages = list;
+    pager->warm_count = n;
+    pager->warm_next = 0;
+
+    // Start the kernel reading every run now; the steps then mostly hit memory
+    for (uint32_t i = 0; i < n;) {
+        uint32_t j = i + 1;
+        while (j < n && pager->warm_pages[j] == pager->warm_pages[j - 1] + 1) j++;
+        posix_fadvise(fileno(pager->file), page_offset(pager->warm_pages[i]),
+                      (off_t)(j - i) * PAGE_SIZE, POSIX_FADV_WILLNEED);
+        i = j;
+    }
+    return n;
+}
+
+bool pager_warm_step(Pager *pager, uint32_t max_pages) {
+    uint8_t *buf = NULL;
+
+    while (max_pages > 0 && pager->warm_next < pager->warm_count) {
+        uint32_t *q = pager->warm_pages;
+        uint32_t first = q[pager->warm_next];
+
+        // Loaded on demand in the meantime, or released: nothing to do
+        if (pager->pages[first] || released_test(pager, first)) {
+            pager->warm_next++;
+            continue;
+        }
+
+        // One read for the run of adjacent, still-missing pages
+        uint32_t count = 1;
+        while (pager->warm_next + count < pager->warm_count && count < max_pages &&
+               count < WARM_CHUNK_PAGES &&
+               q[pager->warm_next + count] == first + count &&
+               !pager->pages[first + count] && !released_test(pager, first + count)) {
+            count++;
+        }
+
+        if (!buf) {
+            buf = malloc((size_t)WARM_CHUNK_PAGES * PAGE_SIZE);
+            if (!buf) die("malloc");
+        }
+        if (fseek(pager->file, page_offset(first), SEEK_SET) != 0) die("fseek");
+        if (fread(buf, PAGE_SIZE, count, pager->file) != count) die("fread");
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t *src = buf + (size_t)i * PAGE_SIZE;
+            if (!page_checksum_ok(pager, src)) {
+                fprintf(stderr, "corrupt db (checksum mismatch on page %u)\n", first + i);
+                exit(1);
+            }
+            void *page = malloc(PAGE_SIZE);
+            if (!page) die("malloc");
+            memcpy(page, src, PAGE_SIZE);
+            page_install(pager, first + i, page, PAGER_QUEUE_PROTECTED);
+        }
+
+        pager->warm_next += count;
+        max_pages -= count;
+    }
+
+    free(buf);
+    return pager->warm_next >= pager->warm_count;
+}
+
+uint32_t pager_verify(Pager *pager, uint32_t *bad, uint32_t max_bad) {
+    if (!pager->file) return 0;  // nothing on disk to check
+    if (fseek(pager->file, 0, SEEK_END) != 0) die("fseek");
+    long size = ftell(pager->file);
+    if (size < 0) die("ftell");
+    uint32_t file_pages = (uint32_t)(size / PAGE_SIZE);
+
+    uint8_t *buf = malloc((size_t)VERIFY_CHUNK_PAGES * PAGE_SIZE);
+    if (!buf) die("malloc");
+
+    // Large sequential reads; checksumming is far cheaper than the I/O
+    uint32_t nbad = 0;
+    if (fseek(pager->file, 0, SEEK_SET) != 0) die("fseek");
+    for (uint32_t first = 0; first < file_pages; first += VERIFY_CHUNK_PAGES) {
+        uint32_t n = file_pages - first;
+        if (n > VERIFY_CHUNK_PAGES) n = VERIFY_CHUNK_PAGES;
+        if (fread(buf, PAGE_SIZE, n, pager->file) != n) die("fread");
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (page_checksum_ok(pager, buf + (size_t)i * PAGE_SIZE)) continue;
+            if (nbad < max_bad) bad[nbad] = first + i;
+            nbad++;
+        }
+    }
+
+    free(buf);
+    return nbad;
+}
+
+/* ============================================================
+ * Online backup
+ * ============================================================ */
+
+PagerBackup *pager_backup_begin(Pager *pager, const char *dest_filename, const uint8_t *only_pages) {
+    FILE *dest = fopen(dest_filename, "w+b");
+    if (!dest) return NULL;
+
+    PagerBackup *b = calloc(1, sizeof(PagerBackup));
+    if (!b) die("calloc");
+    b->buf = malloc((size_t)BACKUP_CHUNK_PAGES * PAGE_SIZE);
+    if (!b->buf) die("malloc");
+
+    b->src = pager;
+    b->dest = dest;
+    b->full_pass = true;
+    b->pass_seq = pager->change_seq;
+
+    if (only_pages) {
+        b->page_log = true;
+        memcpy(b->only_pages, only_pages, PAGER_CHANGE_MAP_SIZE);
+        if (fwrite(PAGER_LOG_MAGIC, PAGER_LOG_MAGIC_SIZE, 1, dest) != 1) die("fwrite");
+    }
+    return b;
+}
+
+static bool backup_wants_page(PagerBackup *b, uint32_t page_num) {
+    if (b->full_pass) return !b->page_log || PAGER_PAGE_CHANGED(b->only_pages, page_num);
+    return b->src->page_seq[page_num] > b->since_seq;
+}
+
+/* Copy pages [first, first + count) into the backup file */
+static void backup_copy_run(PagerBackup *b, uint32_t first, uint32_t count) {
+    Pager *p = b->src;
+
+    for (uint32_t i = 0; i < count;) {
+        uint8_t *dst = b->buf + (size_t)i * PAGE_SIZE;
+
+        // Cached pages are the newest version; checksum the copy
+        if (p->pages[first + i]) {
+            memcpy(dst, p->pages[first + i], PAGE_SIZE);
+            *page_trailer(dst) = page_crc(dst);
+            i++;
+            continue;
+        }
+
+        // Everything else is read straight from disk, a whole stretch at once
+        uint32_t j = i;
+        while (j < count && !p->pages[first + j]) j++;
+
+        // released pages may never have reached the file: past its end reads as zeros
+        if (fseek(p->file, page_offset(first + i), SEEK_SET) != 0) die("fseek");
+        size_t got = fread(dst, PAGE_SIZE, j - i, p->file);
+        if (got != j - i) {
+            if (ferror(p->file)) die("fread");
+            memset(dst + got * PAGE_SIZE, 0, (j - i - got) * PAGE_SIZE);
+        }
+        i = j;
+    }
+
+    if (b->page_log) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t page_num = first + i;
+            if (fwrite(&page_num, sizeof(page_num), 1, b->dest) != 1) die("fwrite");
+            if (fwrite(b->buf + (size_t)i * PAGE_SIZE, PAGE_SIZE, 1, b->dest) != 1) die("fwrite");
+        }
+        return;
+    }
+
+    if (fseek(b->dest, page_offset(first), SEEK_SET) != 0) die("fseek");
+    if (fwrite(b->buf, PAGE_SIZE, count, b->dest) != count) die("fwrite");
+}
+
+bool pager_backup_step(PagerBackup *b, uint32_t max_pages) {
+    Pager *p = b->src;
+
+    while (max_pages > 0) {
+        while (b->next_page < p->num_pages && !backup_wants_page(b, b->next_page))
+            b->next_page++;
+
+        if (b->next_page >= p->num_pages) {
+            // Pass finished: anything modified since it started needs another pass
+            if (p->change_seq == b->pass_seq) return true;
+
+            b->full_pass = false;
+            b->since_seq = b->pass_seq;
+            b->pass_seq = p->change_seq;
+            b->next_page = 0;
+            continue;
+        }
+
+        uint32_t first = b->next_page;
+        uint32_t count = 0;
+        while (first + count < p->num_pages &&
+               count < max_pages && count < BACKUP_CHUNK_PAGES &&
+               backup_wants_page(b, first + count)) {
+            count++;
+        }
+
+        backup_copy_run(b, first, count);
+        b->next_page += count;
+        max_pages -= count;
+    }
+
+    return false;
+}
+
+bool pager_backup_close(PagerBackup *b) {
+    if (!b) return true;
+    // a backup reported complete must survive a power loss
+    bool ok = fflush(b->dest) == 0 && fsync(fileno(b->dest)) == 0;
+    if (fclose(b->dest) != 0) ok = false;
+    free(b->buf);
+    free(b);
+    return ok;
+}
+
+FILE *pager_log_open(const char *filename) {
+    FILE *log = fopen(filename, "rb");
+    if (!log) return NULL;
+
+    char magic[PAGER_LOG_MAGIC_SIZE];
+    if (fread(magic, sizeof(magic), 1, log) != 1 ||
+        memcmp(magic, PAGER_LOG_MAGIC, PAGER_LOG_MAGIC_SIZE) != 0) {
+        fclose(log);
+        return NULL;
+    }
+    return log;
+}
+
+int pager_log_next(FILE *log, uint32_t *page_num, void *page) {
+    if (fread(page_num, sizeof(*page_num), 1, log) != 1) return feof(log) ? 0 : -1;
+    if (fread(page, PAGE_SIZE, 1, log) != 1) return -1;
+    if (*page_num >= PAGER_FILE_MAX_PAGES || !pager_checksum_ok(page, false)) return -1;
+    return 1;
 }
@@ -0,0 +1,361 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "replica.h"
+#include "db.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Replicator {
+    Table *t;
+    int listen_fd;
+    int peer_fd;            // -1 until a follower connects
+    uint64_t shipped_seq;   // pages changed after this still need shipping
+    uint64_t acked_seq;     // newest shipment the follower has applied
+    uint64_t follower_lag_us;
+    uint64_t shipments;
+    uint64_t pages_shipped;
+    uint8_t *buf;
+};
+
+struct Follower {
+    Table *t;
+    int fd;                 // -1 once the primary disconnects
+    uint8_t *staged;        // pages of the shipment being received
+    uint32_t *staged_nums;
+    uint32_t staged_count;
+    uint32_t staged_cap;
+    uint64_t applied_seq;
+    uint64_t last_lag_us;
+    uint64_t max_lag_us;
+    uint64_t commits;
+};
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void set_error(char *errbuf, uint32_t errbuf_sz, const char *what, const char *path) {
+    if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "%s %s: %s", what, path, strerror(errno));
+}
+
+static bool make_address(struct sockaddr_un *addr, const char *socket_path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return true;
+}
+
+/* Blocking I/O helpers; false means the peer went away */
+static bool write_all(int fd, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t len) {
+    uint8_t *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* ============================================================
+ * Primary
+ * ============================================================ */
+
+Replicator *replica_listen(Table *t, const char *socket_path, char *errbuf, uint32_t errbuf_sz) {
+    struct sockaddr_un addr;
+    if (!make_address(&addr, socket_path)) {
+        set_error(errbuf, errbuf_sz, "cannot listen on", socket_path);
+        return NULL;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) die("socket");
+
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        set_error(errbuf, errbuf_sz, "cannot listen on", socket_path);
+        close(fd);
+        return NULL;
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0) die("fcntl");
+
+    Replicator *r = calloc(1, sizeof(Replicator));
+    if (!r) die("calloc");
+    r->buf = malloc((size_t)REPLICA_FRAME_PAGES * (sizeof(uint32_t) + PAGE_SIZE));
+    if (!r->buf) die("malloc");
+
+    r->t = t;
+    r->listen_fd = fd;
+    r->peer_fd = -1;
+    return r;
+}
+
+static void drop_follower(Replicator *r) {
+    close(r->peer_fd);
+    r->peer_fd = -1;
+}
+
+/*
+ * Ship pages in frames of up to REPLICA_FRAME_PAGES. With full set, every
+ * page goes out (new follower); otherwise pages changed after shipped_seq.
+ */
+static bool ship_pages(Replicator *r, bool full) {
+    Pager *p = r->t->pager;
+    uint64_t seq = p->change_seq;
+    uint64_t sent_us = now_us();
+
+    uint32_t page = 0;
+    bool committed = false;
+    while (!committed) {
+        uint32_t count = 0;
+        uint8_t *out = r->buf;
+        for (; page < p->num_pages && count < REPLICA_FRAME_PAGES; page++) {
+            if (!full && p->page_seq[page] <= r->shipped_seq) continue;
+
+            // a released page goes out as zeros; getting it would take it back into use
+            memcpy(out, &page, sizeof(page));
+            if (pager_released(p, page)) memset(out + sizeof(page), 0, PAGE_SIZE);
+            else memcpy(out + sizeof(page), pager_get_page(p, page), PAGE_SIZE);
+            pager_checksum_stamp(out + sizeof(page));  // resident pages may be newer than their trailer
+            out += sizeof(page) + PAGE_SIZE;
+            count++;
+        }
+        while (page < p->num_pages && !full && p->page_seq[page] <= r->shipped_seq) page++;
+        committed = (page >= p->num_pages);
+
+        ReplicaFrame frame = {0};
+        frame.magic = REPLICA_MAGIC;
+        frame.flags = committed ? REPLICA_FRAME_COMMIT : 0;
+        frame.num_pages = count;
+        frame.seq = seq;
+        frame.sent_us = sent_us;
+
+        if (!write_all(r->peer_fd, &frame, sizeof(frame)) ||
+            !write_all(r->peer_fd, r->buf, (size_t)(out - r->buf))) {
+            return false;
+        }
+        r->pages_shipped += count;
+    }
+
+    r->shipped_seq = seq;
+    r->shipments++;
+    return true;
+}
+
+/* Drain acknowledgements, waiting up to wait_ms for the first one */
+static void read_acks(Replicator *r, int wait_ms) {
+    while (r->peer_fd >= 0) {
+        struct pollfd pfd = { .fd = r->peer_fd, .events = POLLIN };
+        if (poll(&pfd, 1, wait_ms) <= 0) return;
+        wait_ms = 0;
+
+        ReplicaAck ack;
+        if (!read_all(r->peer_fd, &ack, sizeof(ack))) {
+            drop_follower(r);
+            return;
+        }
+        r->acked_seq = ack.seq;
+        r->follower_lag_us = ack.lag_us;
+    }
+}
+
+void replica_ship(Replicator *r) {
+    if (r->peer_fd < 0) {
+        int fd = accept(r->listen_fd, NULL, NULL);
+        if (fd < 0) return;  // nobody waiting
+
+        r->peer_fd = fd;
+        db_sync_header(r->t);
+        if (!ship_pages(r, true)) drop_follower(r);
+        return;
+    }
+
+    read_acks(r, 0);
+    if (r->peer_fd < 0) return;
+
+    db_sync_header(r->t);
+    if (r->t->pager->change_seq == r->shipped_seq) return;
+
+    // One shipment in flight at a time. A follower that does not catch up
+    // within the wait gets these changes later, merged with whatever else
+    // changes in the meantime, so the primary never stalls for long.
+    if (r->acked_seq != r->shipped_seq) read_acks(r, REPLICA_ACK_WAIT_MS);
+    if (r->peer_fd < 0 || r->acked_seq != r->shipped_seq) return;
+
+    if (!ship_pages(r, false)) drop_follower(r);
+}
+
+void replica_print_status(Replicator *r) {
+    if (r->peer_fd >= 0) read_acks(r, 0);
+    if (r->peer_fd < 0) {
+        puts("Primary: no follower connected.");
+        return;
+    }
+    printf("Primary: seq %llu, shipped %llu, acked %llu, follower lag %.3f ms\n",
+           (unsigned long long)r->t->pager->change_seq,
+           (unsigned long long)r->shipped_seq,
+           (unsigned long long)r->acked_seq,
+           (double)r->follower_lag_us / 1000.0);
+    printf("  %llu shipments, %llu pages\n",
+           (unsigned long long)r->shipments, (unsigned long long)r->pages_shipped);
+}
+
+void replica_close(Replicator *r) {
+    if (!r) return;
+    if (r->peer_fd >= 0) close(r->peer_fd);
+    close(r->listen_fd);
+    free(r->buf);
+    free(r);
+}
+
+/* ============================================================
+ * Follower
+ * ============================================================ */
+
+Follower *replica_follow(Table *t, const char *socket_path, char *errbuf, uint32_t errbuf_sz) {
+    struct sockaddr_un addr;
+    if (!make_address(&addr, socket_path)) {
+        set_error(errbuf, errbuf_sz, "cannot connect to", socket_path);
+        return NULL;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) die("socket");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        set_error(errbuf, errbuf_sz, "cannot connect to", socket_path);
+        close(fd);
+        return NULL;
+    }
+
+    Follower *f = calloc(1, sizeof(Follower));
+    if (!f) die("calloc");
+    f->t = t;
+    f->fd = fd;
+    return f;
+}
+
+static void stage_page(Follower *f, uint32_t page_num, const uint8_t *page) {
+    if (f->staged_count == f->staged_cap) {
+        f->staged_cap = f->staged_cap ? f->staged_cap * 2 : REPLICA_FRAME_PAGES;
+        f->staged = realloc(f->staged, (size_t)f->staged_cap * PAGE_SIZE);
+        f->staged_nums = realloc(f->staged_nums, (size_t)f->staged_cap * sizeof(uint32_t));
+        if (!f->staged || !f->staged_nums) die("realloc");
+    }
+    memcpy(f->staged + (size_t)f->staged_count * PAGE_SIZE, page, PAGE_SIZE);
+    f->staged_nums[f->staged_count++] = page_num;
+}
+
+static void apply_staged(Follower *f, const ReplicaFrame *frame) {
+    for (uint32_t i = 0; i < f->staged_count; i++) {
+        pager_put_page(f->t->pager, f->staged_nums[i], f->staged + (size_t)i * PAGE_SIZE);
+    }
+    f->staged_count = 0;
+    db_reload_header(f->t);
+
+    uint64_t now = now_us();
+    f->last_lag_us = now > frame->sent_us ? now - frame->sent_us : 0;
+    if (f->last_lag_us > f->max_lag_us) f->max_lag_us = f->last_lag_us;
+    f->applied_seq = frame->seq;
+    f->commits++;
+}
+
+/* Read one frame; false if the primary went away or sent garbage */
+static bool receive_frame(Follower *f) {
+    ReplicaFrame frame;
+    if (!read_all(f->fd, &frame, sizeof(frame)) || frame.magic != REPLICA_MAGIC) return false;
+
+    uint8_t *page = malloc(PAGE_SIZE);
+    if (!page) die("malloc");
+    for (uint32_t i = 0; i < frame.num_pages; i++) {
+        uint32_t page_num;
+        if (!read_all(f->fd, &page_num, sizeof(page_num)) ||
+            !read_all(f->fd, page, PAGE_SIZE) ||
+            page_num >= f->t->pager->max_pages || !pager_checksum_ok(page, true)) {
+            free(page);
+            return false;
+        }
+        stage_page(f, page_num, page);
+    }
+    free(page);
+
+    if (frame.flags & REPLICA_FRAME_COMMIT) {
+        apply_staged(f, &frame);
+        ReplicaAck ack = { frame.seq, f->last_lag_us };
+        if (!write_all(f->fd, &ack, sizeof(ack))) return false;
+    }
+    return true;
+}
+
+void replica_wait_input(Follower *f, FILE *input) {
+    int input_fd = fileno(input);
+    while (f->fd >= 0) {
+        struct pollfd pfds[2] = {
+            { .fd = input_fd, .events = POLLIN },
+            { .fd = f->fd, .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+
+        // apply shipments before serving the statement that is waiting
+        if (pfds[1].revents) {
+            if (!receive_frame(f)) {
+                close(f->fd);
+                f->fd = -1;
+                f->staged_count = 0;  // an incomplete shipment is discarded
+                puts("Primary disconnected.");
+            }
+            continue;
+        }
+        if (pfds[0].revents) return;
+    }
+}
+
+void replica_print_follower_status(Follower *f) {
+    printf("Follower: %s, applied seq %llu, %llu commits\n",
+           f->fd >= 0 ? "connected" : "disconnected",
+           (unsigned long long)f->applied_seq, (unsigned long long)f->commits);
+    printf("  lag last %.3f ms, max %.3f ms\n",
+           (double)f->last_lag_us / 1000.0, (double)f->max_lag_us / 1000.0);
+}
+
+void replica_unfollow(Follower *f) {
+    if (!f) return;
+    if (f->fd >= 0) close(f->fd);
+    free(f->staged);
+    free(f->staged_nums);
+    free(f);
+}
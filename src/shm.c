@@ -0,0 +1,219 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "shm.h"
+#include "db.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SHM_TABLE_LATCH  0
+#define SHM_WRITER_LATCH 1
+
+struct SharedDb {
+    Table *t;
+    int fd;
+    ShmHeader *hdr;
+    bool writer;
+    int slot;                  // reader slot index, -1 for the writer
+    bool reading;              // table latch held shared
+    uint64_t seen_generation;  // reader: snapshot the table was last loaded from
+    uint64_t published_seq;    // writer: pages changed after this are unpublished
+};
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static void set_error(char *errbuf, uint32_t errbuf_sz, const char *what, const char *path) {
+    if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "%s %s: %s", what, path, strerror(errno));
+}
+
+/* fcntl lock on one byte; type is F_RDLCK, F_WRLCK or F_UNLCK */
+static bool latch(int fd, off_t byte, short type, bool wait) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+
+    while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) != 0) {
+        if (errno == EINTR) continue;
+        if (!wait && (errno == EACCES || errno == EAGAIN)) return false;
+        die("fcntl");
+    }
+    return true;
+}
+
+static bool pid_alive(int32_t pid) {
+    return kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * Reader, under the table latch: pick up the latest publish. Mapped pages
+ * are not checksummed on every access; page 0 is, since it decides
+ * where everything else is.
+ */
+static void load_snapshot(Table *t) {
+    pager_remap(t->pager);
+    db_reload_header(t);
+    if (!pager_checksum_ok(pager_get_page(t->pager, 0), t->pager->checksums_required)) {
+        fprintf(stderr, "corrupt db (checksum mismatch on page 0)\n");
+        exit(1);
+    }
+}
+
+/* Under the exclusive table latch: take a free or abandoned reader slot */
+static int claim_slot(ShmHeader *hdr) {
+    for (int i = 0; i < SHM_MAX_READERS; i++) {
+        ShmReaderSlot *slot = &hdr->readers[i];
+        if (slot->pid == 0 || !pid_alive(slot->pid)) {
+            slot->pid = (int32_t)getpid();
+            slot->generation = hdr->generation;
+            return i;
+        }
+    }
+    return -1;
+}
+
+SharedDb *shm_attach(Table *t, const char *db_filename, bool writer,
+                     char *errbuf, uint32_t errbuf_sz) {
+    char path[512];
+    if (snprintf(path, sizeof(path), "%s-shm", db_filename) >= (int)sizeof(path)) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "database path too long");
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        set_error(errbuf, errbuf_sz, "cannot open", path);
+        return NULL;
+    }
+
+    if (writer && !latch(fd, SHM_WRITER_LATCH, F_WRLCK, false)) {
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "another writer is attached to %s", db_filename);
+        close(fd);
+        return NULL;
+    }
+
+    // Size and initialise the segment once, whoever comes first
+    latch(fd, SHM_TABLE_LATCH, F_WRLCK, true);
+    if (ftruncate(fd, sizeof(ShmHeader)) != 0) die("ftruncate");
+
+    ShmHeader *hdr = mmap(NULL, sizeof(ShmHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) die("mmap");
+
+    if (memcmp(hdr->magic, SHM_MAGIC, SHM_MAGIC_SIZE) != 0) {
+        memset(hdr, 0, sizeof(ShmHeader));
+        memcpy(hdr->magic, SHM_MAGIC, SHM_MAGIC_SIZE);
+    }
+
+    int slot = -1;
+    if (writer) {
+        hdr->writer_pid = (int32_t)getpid();
+    } else if ((slot = claim_slot(hdr)) < 0) {
+        latch(fd, SHM_TABLE_LATCH, F_UNLCK, true);
+        if (errbuf && errbuf_sz) snprintf(errbuf, errbuf_sz, "all %d reader slots are in use", SHM_MAX_READERS);
+        munmap(hdr, sizeof(ShmHeader));
+        close(fd);
+        return NULL;
+    }
+
+    // A reader's first look at the header must not race a publish
+    uint64_t seen = UINT64_MAX;
+    if (!writer) {
+        load_snapshot(t);
+        seen = hdr->generation;
+    }
+    latch(fd, SHM_TABLE_LATCH, F_UNLCK, true);
+
+    SharedDb *s = calloc(1, sizeof(SharedDb));
+    if (!s) die("calloc");
+
+    s->t = t;
+    s->fd = fd;
+    s->hdr = hdr;
+    s->writer = writer;
+    s->slot = slot;
+    s->seen_generation = seen;
+
+    // Whatever the writer still holds in memory goes out with its first publish
+    if (writer) shm_publish(s);
+    return s;
+}
+
+void shm_publish(SharedDb *s) {
+    Table *t = s->t;
+    Pager *p = t->pager;
+
+    db_sync_header(t);
+    if (p->change_seq == s->published_seq && s->hdr->num_pages == p->num_pages) return;
+
+    latch(s->fd, SHM_TABLE_LATCH, F_WRLCK, true);
+    pager_flush_since(p, s->published_seq);
+    // readers map or read the file itself: the pages must leave stdio's buffer first
+    if (fflush(p->file) != 0) die("fflush");
+    s->hdr->num_pages = p->num_pages;
+    s->hdr->generation++;
+    latch(s->fd, SHM_TABLE_LATCH, F_UNLCK, true);
+
+    s->published_seq = p->change_seq;
+}
+
+void shm_read_begin(SharedDb *s) {
+    if (s->reading) return;
+    latch(s->fd, SHM_TABLE_LATCH, F_RDLCK, true);
+    s->reading = true;
+
+    // Unchanged generation: the mapping and the header copy are current
+    uint64_t gen = s->hdr->generation;
+    if (gen != s->seen_generation) {
+        load_snapshot(s->t);
+        s->seen_generation = gen;
+    }
+    s->hdr->readers[s->slot].generation = gen;
+}
+
+void shm_read_end(SharedDb *s) {
+    if (!s->reading) return;
+    latch(s->fd, SHM_TABLE_LATCH, F_UNLCK, true);
+    s->reading = false;
+}
+
+void shm_print_status(SharedDb *s) {
+    ShmHeader *hdr = s->hdr;
+
+    printf("Shared %s, generation %llu, %u pages published.\n",
+           s->writer ? "writer" : "reader",
+           (unsigned long long)hdr->generation, hdr->num_pages);
+
+    for (int i = 0; i < SHM_MAX_READERS; i++) {
+        ShmReaderSlot *slot = &hdr->readers[i];
+        if (slot->pid == 0 || !pid_alive(slot->pid)) continue;
+        printf("  reader pid %d at generation %llu%s\n", slot->pid,
+               (unsigned long long)slot->generation, i == s->slot ? " (this process)" : "");
+    }
+}
+
+void shm_detach(SharedDb *s) {
+    if (!s) return;
+
+    if (s->writer) {
+        shm_publish(s);
+    } else {
+        shm_read_end(s);
+        latch(s->fd, SHM_TABLE_LATCH, F_WRLCK, true);
+        s->hdr->readers[s->slot].pid = 0;
+        latch(s->fd, SHM_TABLE_LATCH, F_UNLCK, true);
+    }
+
+    if (munmap(s->hdr, sizeof(ShmHeader)) != 0) die("munmap");
+    close(s->fd);  // also drops the writer latch
+    free(s);
+}